@@ -187,6 +187,7 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
    * half-destroyed address space. This tends to be
    * messily fatal.
    */
+  proc_vmexit(curproc);
   as = curproc_setas(NULL);
   as_destroy(as);
 
@@ -301,6 +302,13 @@ mips_trap(struct trapframe *tf)
 	spl = splhigh();
 	splx(spl);
 
+#if OPT_A3
+	/* from user mode: where its stack is, for growing it */
+	if (!iskern) {
+		curthread->t_usersp = tf->tf_sp;
+	}
+#endif
+
 	/* Syscall? Call the syscall handler and return. */
 	if (code == EX_SYS) {
 		/* Interrupts should have been on while in user mode. */
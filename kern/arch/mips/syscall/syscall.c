@@ -36,6 +36,10 @@
 #include <current.h>
 #include <syscall.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <kmem_cache.h>
+#endif
 
 
 /*
@@ -138,6 +142,14 @@ syscall(struct trapframe *tf)
 	case SYS_execv:
 	  err = sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
 	  break;
+#endif
+#if OPT_A3
+	case SYS_sbrk:
+	  err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+	  break;
+	case SYS_getrusage:
+	  err = sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+	  break;
 #endif
 	    /* Add stuff here */
  
@@ -189,7 +201,11 @@ void
 enter_forked_process(void *tf, unsigned long data)
 {	
 	struct trapframe stacktf = *(struct trapframe *)tf;
+#if OPT_A3
+	kmem_cache_free(&trapframe_cache, tf);
+#else
 	kfree(tf);
+#endif
 	stacktf.tf_v0 = data;
 	stacktf.tf_a3 = 0;
 	stacktf.tf_epc += 4;
@@ -38,6 +38,8 @@
 #include <platform/maxcpus.h>
 #include <cpu.h>
 #include <thread.h>
+#include <vm.h>
+#include "opt-A3.h"
 
 ////////////////////////////////////////////////////////////
 
@@ -219,6 +221,17 @@ wait(void)
 void 
 cpu_idle(void)
 {
+#if OPT_A3
+	/*
+	 * Use the time to zero a page for later, if any are wanted.
+	 * Let pending interrupts in between pages, since we won't be
+	 * waiting for them.
+	 */
+	if (vm_idlezero()) {
+		cpu_irqonoff();
+		return;
+	}
+#endif
 	wait();
         cpu_irqonoff();
 }
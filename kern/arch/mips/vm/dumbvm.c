@@ -34,9 +34,20 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
+#include <thread.h>
+#include <synch.h>
+#include <uio.h>
+#include <clock.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <vnode.h>
+#include <swapfile.h>
+#include <pagecache.h>
+#include <uw-vmstats.h>
+#include <kmem_cache.h>
 #include "opt-A3.h"
 
 /*
@@ -47,188 +58,3000 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
+#if OPT_A3
+/* user stacks start at one page and may grow to 4M */
+#define STACK_INITPAGES      1
+#define STACK_MAXPAGES       1024
+#define STACK_SLACK          256	/* bytes below sp a fault may be */
+#endif
+
 /*
  * Wrap rma_stealmem in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
 #if OPT_A3
+/*
+ * Physical page allocator.
+ *
+ * The frames above the coremap are managed by a binary buddy
+ * allocator. A free block of order k is 2^k frames long, starts on a
+ * frame number that is a multiple of 2^k, and sits on freelists[k].
+ * The lists are doubly linked through the coremap entries (by frame
+ * number) so that a block can be pulled off its list in O(1) when its
+ * buddy is freed and the two coalesce.
+ *
+ * Requests that are not a power of two in size are carved out of the
+ * next larger block and the unused tail is handed straight back, so
+ * an allocation never holds more frames than it asked for. The head
+ * entry of an allocated block remembers how many frames it covers;
+ * free_kpages uses that to release it.
+ *
+ * User pages also carry a reference count: the number of page table
+ * entries that point at the frame. Fork shares frames copy-on-write
+ * instead of copying them, and the frame goes back to the allocator
+ * when the last mapping lets go of it.
+ *
+ * A user page with exactly one mapping also records who maps it
+ * (cm_as/cm_vpn) so that the page-out code can find and rewrite its
+ * page table entry. Only such pages are candidates for eviction, and
+ * they are kept on a circular list (the LRU list, through the same
+ * links a free block uses) for the clock to sweep; shared pages have
+ * no single owner and stay put until they are either copied or
+ * freed. (Shared pages made by the page merger, see merge_pages, are
+ * marked cm_merged.) Frames of shared program text (see text_lookup) are never
+ * owned either, and point at their entry in the text cache instead.
+ *
+ * Every frame says what it is being used for (cm_state): free,
+ * which includes frames parked in the magazines and the zero pool,
+ * handed out by alloc_kpages, or holding a user page or shared text.
+ *
+ * The entry is 16 bytes, so that entries never straddle a cache line
+ * and the coremap costs 0.4% of memory. To fit, frame numbers are 16
+ * bits; memory beyond CM_MAXFRAMES frames (256M) is left unused.
+ */
+#define CM_MAXORDER     16	/* blocks of up to 2^15 frames (128M) */
+#define CM_NOFRAME      0xffff
+#define CM_MAXFRAMES    CM_NOFRAME
+
+/* cm_state */
+#define CM_FREE         0	/* not allocated */
+#define CM_KERNEL       1	/* allocated by alloc_kpages */
+#define CM_USER         2	/* user page, see upage_alloc */
+#define CM_TEXT         3	/* user page in the text cache */
+
+struct coremap_entry {
+	union {
+		struct addrspace *cmu_as; /* CM_USER: sole owner, if any */
+		struct textpage *cmu_text; /* CM_TEXT: text cache entry */
+		void *cmu_kmref;	/* CM_KERNEL: kmalloc's pageref */
+	} cm_u;
+	unsigned cm_vpn:20;	/* owner's virtual page number */
+	unsigned cm_state:2;
+	unsigned cm_dirty:1;	/* CM_USER: not backed by swap or program */
+	unsigned cm_free:1;	/* heads a free block */
+	unsigned cm_order:4;	/* ...of this order */
+	unsigned cm_merged:1;	/* CM_USER: stands in for merged pages */
+	unsigned :3;
+	uint16_t cm_next;	/* next free block of this order, or owned page */
+	uint16_t cm_prev;	/* previous ditto */
+	uint16_t cm_npages;	/* frames in use (allocated block head) */
+	uint16_t cm_refcount;	/* mappings of a user page */
+};
+#define cm_as           cm_u.cmu_as
+#define cm_text         cm_u.cmu_text
+#define cm_kmref        cm_u.cmu_kmref
+
 static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
-static int *coremap;
+static struct coremap_entry *coremap;
+static int freelists[CM_MAXORDER];
+static unsigned freeblocks[CM_MAXORDER];
+static unsigned freepages;
 static paddr_t startcont;
 static int num;
+static int nfcore;
 static int comp = 0;
-#endif
+static int clock_hand;		/* on the LRU list, or CM_NOFRAME */
+static unsigned lru_count;	/* owned pages */
+static unsigned clean_evictions; /* pages dropped without a page-out */
+static unsigned merge_scanned;	/* owned pages hashed by the merger */
+static unsigned merge_merged;	/* ...and found a twin, and freed */
 
+// buddy free list helpers /////////////////////////////////////////////
+static
 void
-vm_bootstrap(void)
+buddy_push(int frame, unsigned order)
 {
-#if OPT_A3
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(order < CM_MAXORDER);
+
+	coremap[frame].cm_free = 1;
+	coremap[frame].cm_order = order;
+	coremap[frame].cm_npages = 0;
+	coremap[frame].cm_prev = CM_NOFRAME;
+	coremap[frame].cm_next = freelists[order];
+	if (freelists[order] != CM_NOFRAME) {
+		coremap[freelists[order]].cm_prev = frame;
+	}
+	freelists[order] = frame;
+	freeblocks[order]++;
+	freepages += 1U << order;
+}
 
-	paddr_t endcont;
+static
+void
+buddy_unlink(int frame)
+{
+	unsigned order = coremap[frame].cm_order;
 
-	ram_getsize(&startcont, &endcont);
-	
-	coremap = (int *)PADDR_TO_KVADDR(startcont);
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap[frame].cm_free);
 
-	// total frames available
-	num = (endcont - startcont) / PAGE_SIZE;
+	if (coremap[frame].cm_prev != CM_NOFRAME) {
+		coremap[coremap[frame].cm_prev].cm_next = coremap[frame].cm_next;
+	} else {
+		freelists[order] = coremap[frame].cm_next;
+	}
+	if (coremap[frame].cm_next != CM_NOFRAME) {
+		coremap[coremap[frame].cm_next].cm_prev = coremap[frame].cm_prev;
+	}
+	coremap[frame].cm_free = 0;
+	freeblocks[order]--;
+	freepages -= 1U << order;
+}
 
-	// num of frames for core map
-	int nfcore = num * 4 / PAGE_SIZE + 1;
+/*
+ * Return one aligned block of 2^order frames to the free lists,
+ * merging it with its buddy for as long as the buddy is free too.
+ */
+static
+void
+buddy_free_block(int frame, unsigned order)
+{
+	int buddy;
+
+	while (order + 1 < CM_MAXORDER) {
+		buddy = frame ^ (1 << order);
+		if (buddy + (1 << order) > num ||
+		    !coremap[buddy].cm_free ||
+		    coremap[buddy].cm_order != order) {
+			break;
+		}
+		buddy_unlink(buddy);
+		if (buddy < frame) {
+			frame = buddy;
+		}
+		order++;
+	}
+	buddy_push(frame, order);
+}
 
-	// real content start location
-	startcont = startcont + nfcore * PAGE_SIZE;
-	num = num - nfcore;
+/*
+ * Free an arbitrary run of frames by splitting it into the largest
+ * aligned power-of-two blocks it contains.
+ */
+static
+void
+buddy_free_range(int frame, int npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order + 1 < CM_MAXORDER &&
+		       (frame & ((1 << (order + 1)) - 1)) == 0 &&
+		       (1 << (order + 1)) <= npages) {
+			order++;
+		}
+		buddy_free_block(frame, order);
+		frame += 1 << order;
+		npages -= 1 << order;
+	}
+}
 
-	KASSERT(coremap != NULL);
-	// initialize core map
-	for(int i = 0; i < num; i++){
-		coremap[i] = 0;
+static
+int
+buddy_alloc(unsigned long npages)
+{
+	unsigned want, order;
+	int frame;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	want = 0;
+	while ((1UL << want) < npages) {
+		want++;
+	}
+	if (want >= CM_MAXORDER) {
+		return CM_NOFRAME;
+	}
+
+	for (order = want; order < CM_MAXORDER; order++) {
+		if (freelists[order] != CM_NOFRAME) {
+			break;
+		}
+	}
+	if (order == CM_MAXORDER) {
+		return CM_NOFRAME;
+	}
+
+	frame = freelists[order];
+	buddy_unlink(frame);
+
+	/* split down, keeping the low half each time */
+	while (order > want) {
+		order--;
+		buddy_push(frame + (1 << order), order);
+	}
+
+	/* give back whatever part of the block wasn't asked for */
+	buddy_free_range(frame + npages, (1 << want) - npages);
+
+	coremap[frame].cm_npages = npages;
+	return frame;
+}
+
+/*
+ * Per-CPU page magazines.
+ *
+ * Single-frame allocations and frees are by far the most common
+ * (user pages, kmalloc subpage refills), so each CPU keeps a small
+ * stack of free frames that it can use without touching
+ * coremap_lock. An empty magazine is refilled with PAGEMAG_BATCH
+ * frames in one trip to the buddy allocator; a full one gives
+ * PAGEMAG_BATCH back the same way.
+ *
+ * Frames sitting in a magazine look allocated (one page) to the buddy
+ * allocator. A magazine is only touched by its own CPU, with
+ * interrupts off so the thread can't be switched or migrated
+ * under us.
+ */
+#define PAGEMAG_SIZE    16
+#define PAGEMAG_BATCH   (PAGEMAG_SIZE / 2)
+
+struct pagemag {
+	int pm_frames[PAGEMAG_SIZE];
+	unsigned pm_count;
+
+	/* statistics */
+	unsigned pm_allocs;	/* single-page allocations */
+	unsigned pm_hits;	/* ...served from the magazine */
+	unsigned pm_frees;	/* single-page frees */
+	unsigned pm_refills;	/* batch refills from the coremap */
+	unsigned pm_drains;	/* batch drains to the coremap */
+};
+
+static struct pagemag pagemags[MAXCPUS];
+
+/*
+ * Hand NFRAMES frames from the top of MAG back to the buddy
+ * allocator. Caller holds coremap_lock.
+ */
+static
+void
+pagemag_drain(struct pagemag *mag, unsigned nframes)
+{
+	int frame;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(nframes <= mag->pm_count);
+
+	while (nframes-- > 0) {
+		frame = mag->pm_frames[--mag->pm_count];
+		KASSERT(coremap[frame].cm_npages == 1);
+		coremap[frame].cm_npages = 0;
+		buddy_free_block(frame, 0);
+	}
+}
+
+static
+int
+pagemag_alloc(void)
+{
+	struct pagemag *mag;
+	int frame, spl;
+
+	spl = splhigh();
+	mag = &pagemags[curcpu->c_number];
+	mag->pm_allocs++;
+
+	if (mag->pm_count > 0) {
+		mag->pm_hits++;
+	}
+	else {
+		spinlock_acquire(&coremap_lock);
+		while (mag->pm_count < PAGEMAG_BATCH) {
+			frame = buddy_alloc(1);
+			if (frame == CM_NOFRAME) {
+				break;
+			}
+			mag->pm_frames[mag->pm_count++] = frame;
+		}
+		spinlock_release(&coremap_lock);
+		mag->pm_refills++;
+
+		if (mag->pm_count == 0) {
+			splx(spl);
+			return CM_NOFRAME;
+		}
+	}
+
+	frame = mag->pm_frames[--mag->pm_count];
+	splx(spl);
+	return frame;
+}
+
+static
+void
+pagemag_free(int frame)
+{
+	struct pagemag *mag;
+	int spl;
+
+	spl = splhigh();
+	mag = &pagemags[curcpu->c_number];
+	mag->pm_frees++;
+
+	if (mag->pm_count == PAGEMAG_SIZE) {
+		spinlock_acquire(&coremap_lock);
+		pagemag_drain(mag, PAGEMAG_BATCH);
+		spinlock_release(&coremap_lock);
+		mag->pm_drains++;
+	}
+
+	mag->pm_frames[mag->pm_count++] = frame;
+	splx(spl);
+}
+
+/*
+ * Pre-zeroed page pool.
+ *
+ * Demand-zero faults and new page tables want frames full of zeros,
+ * and clearing a page on the fault path is pure latency. So idle
+ * CPUs clear frames ahead of time into a shared pool (cpu_idle calls
+ * vm_idlezero, which does one page per call). Once the pool falls
+ * below zp_low they fill it back up to zp_high, but only while more
+ * than zp_high frames are free anyway, so that the pool never pushes
+ * anyone into paging. Frames in the pool look allocated, like those
+ * in the magazines; coremap_alloc takes them back when it runs out.
+ *
+ * Lock order: zeropool_lock, then coremap_lock.
+ */
+#define ZEROPOOL_SIZE   128	/* the most zp_high can be */
+
+static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+static int zp_frames[ZEROPOOL_SIZE];
+static unsigned zp_count;
+static unsigned zp_low = 16;
+static unsigned zp_high = 64;
+static bool zp_filling;
+
+/* statistics */
+static unsigned zp_hits;	/* zeroed pages wanted, found in pool */
+static unsigned zp_misses;	/* ...and zeroed on the spot */
+static unsigned zp_zeroed;	/* pages zeroed while idle */
+static unsigned zp_reclaimed;	/* pool pages taken back for memory */
+
+/*
+ * Take a frame out of the pool, or CM_NOFRAME if it's empty. FORZERO
+ * says whether the caller wants it for its zeros (or just for memory),
+ * for the statistics.
+ */
+static
+int
+zeropool_take(bool forzero)
+{
+	int frame = CM_NOFRAME;
+
+	spinlock_acquire(&zeropool_lock);
+	if (zp_count > 0) {
+		frame = zp_frames[--zp_count];
+		if (forzero) {
+			zp_hits++;
+		}
+		else {
+			zp_reclaimed++;
+		}
+	}
+	else if (forzero) {
+		zp_misses++;
+	}
+	spinlock_release(&zeropool_lock);
+	return frame;
+}
+
+/*
+ * Give all but KEEP of the pool's frames back to the buddy allocator.
+ */
+static
+void
+zeropool_trim(unsigned keep)
+{
+	int frame;
+
+	spinlock_acquire(&zeropool_lock);
+	spinlock_acquire(&coremap_lock);
+	while (zp_count > keep) {
+		frame = zp_frames[--zp_count];
+		KASSERT(coremap[frame].cm_npages == 1);
+		coremap[frame].cm_npages = 0;
+		buddy_free_block(frame, 0);
+		zp_reclaimed++;
+	}
+	spinlock_release(&coremap_lock);
+	spinlock_release(&zeropool_lock);
+}
+
+/*
+ * Zero one page into the pool if it wants filling. Called by idle
+ * CPUs, with interrupts off. Returns true if it did something, so
+ * that the caller comes back rather than waiting for an interrupt.
+ */
+bool
+vm_idlezero(void)
+{
+	bool filling;
+	int frame;
+
+	if (!comp) {
+		return false;
+	}
+
+	spinlock_acquire(&zeropool_lock);
+	if (zp_count < zp_low) {
+		zp_filling = true;
+	}
+	else if (zp_count >= zp_high) {
+		zp_filling = false;
+	}
+	filling = zp_filling;
+	spinlock_release(&zeropool_lock);
+
+	/* unlocked peek; it's only a heuristic */
+	if (!filling || freepages <= zp_high) {
+		return false;
+	}
+
+	frame = pagemag_alloc();
+	if (frame == CM_NOFRAME) {
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR(startcont + frame * PAGE_SIZE),
+	      PAGE_SIZE);
+
+	spinlock_acquire(&zeropool_lock);
+	if (zp_count < zp_high) {
+		zp_frames[zp_count++] = frame;
+		zp_zeroed++;
+		frame = CM_NOFRAME;
+	}
+	spinlock_release(&zeropool_lock);
+
+	if (frame != CM_NOFRAME) {
+		/* another CPU filled it first */
+		pagemag_free(frame);
+	}
+	return true;
+}
+
+/*
+ * Set the pool's watermarks.
+ */
+void
+vm_setzeropool(unsigned low, unsigned high)
+{
+	if (high > ZEROPOOL_SIZE) {
+		high = ZEROPOOL_SIZE;
+	}
+	if (low > high) {
+		low = high;
+	}
+
+	spinlock_acquire(&zeropool_lock);
+	zp_low = low;
+	zp_high = high;
+	zp_filling = false;
+	spinlock_release(&zeropool_lock);
+
+	zeropool_trim(high);
+}
+
+/*
+ * Address space IDs.
+ *
+ * TLB entries are tagged with a 6-bit ASID and only match while
+ * c0_entryhi carries the same one, so several address spaces can
+ * keep translations in the TLB at once and switching between them
+ * needs no flush.
+ *
+ * Each CPU has its own TLB and hands out its own ASIDs, counting up
+ * from 1 (0 is never given out, so the TLBHI_INVALID entries can't
+ * match). The bits of the counter above the ASID are a generation
+ * number: when all 63 ASIDs have been used, the generation goes up
+ * and the TLB is flushed once, which retires everything handed out
+ * so far. An address space remembers the counter value it was given
+ * on each CPU and can keep using it for as long as that generation
+ * is current. Forgetting that value (setting it to 0, which no
+ * generation matches) is how an address space gets rid of all its
+ * translations on a CPU without touching the TLB.
+ */
+#define ASID_BITS       6
+#define ASID_GEN(v)     ((v) >> ASID_BITS)
+#define ASID_PID(v)     ((v) & (NUM_TLBPID - 1))
+
+struct asidcpu {
+	uint32_t ac_next;		/* last value handed out */
+	uint32_t ac_pid;		/* ASID in c0_entryhi */
+	struct addrspace *ac_lastas;	/* last address space activated */
+
+	/* statistics */
+	unsigned ac_activates;		/* as_activate calls */
+	unsigned ac_same;		/* ...for the address space we had */
+	unsigned ac_reused;		/* ...for one whose ASID was still good */
+	unsigned ac_flushes;		/* generation rollovers */
+};
+
+static struct asidcpu asidcpus[MAXCPUS];
+
+/*
+ * Fast TLB refill.
+ *
+ * The UTLB handler in exception-mips1.S walks the page table of the
+ * address space active on its CPU, which it finds in vm_fastpgdir[],
+ * and loads any entry with PTE_REF set straight into the TLB without
+ * building a trap frame. Everything else, and every miss while the
+ * slot is NULL, goes through mips_trap and vm_fault as before. (So
+ * the refills done by the handler don't show up in vmstats.)
+ */
+unsigned int **vm_fastpgdir[MAXCPUS];
+static bool vm_fastrefill = true;
+
+static
+void
+asid_bootstrap(void)
+{
+	unsigned i;
+
+	for (i = 0; i < MAXCPUS; i++) {
+		/* generation 1, so a zeroed as_asid is never current */
+		asidcpus[i].ac_next = 1 << ASID_BITS;
+		asidcpus[i].ac_pid = 0;
+		asidcpus[i].ac_lastas = NULL;
+	}
+}
+
+/*
+ * Is AS's ASID on this CPU still good? Interrupts must be off.
+ */
+static
+bool
+asid_live(struct addrspace *as)
+{
+	unsigned cpu = curcpu->c_number;
+
+	return ASID_GEN(as->as_asid[cpu]) == ASID_GEN(asidcpus[cpu].ac_next);
+}
+
+/*
+ * The TLBHI PID bits for AS on this CPU. Interrupts must be off.
+ */
+static
+uint32_t
+asid_tlbhi(struct addrspace *as)
+{
+	return ASID_PID(as->as_asid[curcpu->c_number]) << TLBHI_PIDSHIFT;
+}
+
+/*
+ * Empty this CPU's TLB. Interrupts must be off.
+ */
+static
+void
+tlb_flush(void)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setpid(asidcpus[curcpu->c_number].ac_pid);
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+/*
+ * Make AS the address space the MMU matches user accesses against,
+ * giving it a fresh ASID if it has none on this CPU. Interrupts must
+ * be off.
+ */
+static
+void
+asid_activate(struct addrspace *as)
+{
+	struct asidcpu *ac = &asidcpus[curcpu->c_number];
+	uint32_t *mine = &as->as_asid[curcpu->c_number];
+	struct addrspace *prev = ac->ac_lastas;
+
+	/* before looking at *mine; see tlbbatch_flush */
+	ac->ac_lastas = as;
+
+	ac->ac_activates++;
+	if (asid_live(as)) {
+		if (as == prev) {
+			ac->ac_same++;
+		}
+		else {
+			ac->ac_reused++;
+		}
+	}
+	else {
+		ac->ac_next++;
+		if (ASID_PID(ac->ac_next) == 0) {
+			/* out of ASIDs: start a new generation */
+			ac->ac_next++;
+			ac->ac_flushes++;
+			tlb_flush();
+		}
+		*mine = ac->ac_next;
+	}
+
+	ac->ac_pid = ASID_PID(*mine);
+	tlb_setpid(ac->ac_pid);
+
+	vm_fastpgdir[curcpu->c_number] = vm_fastrefill ? as->as_pgdir : NULL;
+}
+
+/*
+ * Turn the fast refill path on or off (for benchmarking).
+ */
+void
+vm_setfastrefill(bool on)
+{
+	vm_fastrefill = on;
+	as_activate();
+}
+
+/*
+ * Empty this CPU's TLB (for benchmarking).
+ */
+void
+vm_tlbflush(void)
+{
+	int spl;
+
+	spl = splhigh();
+	tlb_flush();
+	splx(spl);
+}
+
+/*
+ * TLB shootdown.
+ *
+ * When pages of AS are unmapped, or paged out, every CPU that may
+ * still have their old translations has to lose them before the
+ * frames are reused. The pages are collected in a tlbbatch and dealt
+ * with in one go by tlbbatch_flush:
+ *
+ * On this CPU, each page is invalidated; past TLBSHOOTDOWN_MAX of
+ * them AS gets a new ASID instead, which drops the lot.
+ *
+ * On another CPU where AS's ASID is from an old generation, the TLB
+ * can't hold anything of AS's, and the CPU is skipped. Otherwise the
+ * ASID is retired, which is enough if the CPU isn't running AS: it
+ * gets a new one when it next does. Only a CPU that is running AS
+ * gets an IPI, with the whole batch at once, and flushes its TLB if
+ * there are more pages than TLBSHOOTDOWN_MAX. We wait for it.
+ *
+ * A CPU switching to AS just as we look could miss both the retired
+ * ASID and the IPI, so asid_activate sets ac_lastas before it looks
+ * at the ASID, and we retire the ASID before we look at ac_lastas.
+ * One of the two sees the other.
+ *
+ * tlbbatch_flush waits for other CPUs, so it must be called with
+ * interrupts on and no spinlocks held.
+ */
+struct tlbbatch {
+	struct addrspace *tb_as;
+	unsigned tb_count;	/* > TLBSHOOTDOWN_MAX: too many to list */
+	struct tlbshootdown tb_pages[TLBSHOOTDOWN_MAX];
+};
+
+/* statistics */
+static unsigned sd_batches;	/* batches flushed */
+static unsigned sd_ipis;	/* IPIs sent */
+static unsigned sd_retired;	/* other CPUs dealt with by a new ASID */
+static unsigned sd_skipped;	/* other CPUs with nothing to drop */
+static unsigned sd_overflows;	/* batches too big to list */
+
+static
+void
+tlbbatch_init(struct tlbbatch *tb, struct addrspace *as)
+{
+	tb->tb_as = as;
+	tb->tb_count = 0;
+}
+
+static
+void
+tlbbatch_add(struct tlbbatch *tb, vaddr_t vaddr)
+{
+	if (tb->tb_count < TLBSHOOTDOWN_MAX) {
+		tb->tb_pages[tb->tb_count].ts_addrspace = tb->tb_as;
+		tb->tb_pages[tb->tb_count].ts_vaddr = vaddr;
+	}
+	if (tb->tb_count <= TLBSHOOTDOWN_MAX) {
+		tb->tb_count++;
+	}
+}
+
+static void tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+
+static
+void
+tlbbatch_flush(struct tlbbatch *tb)
+{
+	struct addrspace *as = tb->tb_as;
+	uint32_t mask;
+	unsigned i, me;
+	int spl;
+
+	if (tb->tb_count == 0) {
+		return;
+	}
+
+	spl = splhigh();
+	me = curcpu->c_number;
+
+	if (tb->tb_count > TLBSHOOTDOWN_MAX) {
+		sd_overflows++;
+		as->as_asid[me] = 0;
+		if (asidcpus[me].ac_lastas == as) {
+			asid_activate(as);
+		}
+	}
+	else {
+		for (i = 0; i < tb->tb_count; i++) {
+			tlb_invalidate(as, tb->tb_pages[i].ts_vaddr);
+		}
+	}
+
+	mask = 0;
+	for (i = 0; i < MAXCPUS; i++) {
+		if (i == me) {
+			continue;
+		}
+		if (ASID_GEN(as->as_asid[i]) !=
+		    ASID_GEN(asidcpus[i].ac_next)) {
+			sd_skipped++;
+			continue;
+		}
+		as->as_asid[i] = 0;
+		if (asidcpus[i].ac_lastas == as) {
+			mask |= (uint32_t)1 << i;
+			sd_ipis++;
+		}
+		else {
+			sd_retired++;
+		}
+	}
+	sd_batches++;
+	splx(spl);
+
+	if (mask != 0) {
+		ipi_tlbshootdown_wait(mask, tb->tb_pages, tb->tb_count);
+	}
+	tb->tb_count = 0;
+}
+
+/*
+ * Throw away every translation of the current address space AS, on
+ * all CPUs, by giving it new ASIDs.
+ */
+static
+void
+as_flush_tlb(struct addrspace *as)
+{
+	unsigned i;
+	int spl;
+
+	spl = splhigh();
+	for (i = 0; i < MAXCPUS; i++) {
+		as->as_asid[i] = 0;
+	}
+	asid_activate(as);
+	splx(spl);
+}
+#endif
+
+void
+vm_bootstrap(void)
+{
+#if OPT_A3
+
+	paddr_t endcont;
+
+	ram_getsize(&startcont, &endcont);
+	
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(startcont);
+
+	// total frames available
+	num = (endcont - startcont) / PAGE_SIZE;
+
+	KASSERT(sizeof(struct coremap_entry) == 16);
+	if (num > CM_MAXFRAMES) {
+		kprintf("vm: only using %d of %d pages\n", CM_MAXFRAMES, num);
+		num = CM_MAXFRAMES;
+	}
+
+	// num of frames for core map
+	nfcore = DIVROUNDUP(num * sizeof(struct coremap_entry), PAGE_SIZE);
+
+	// real content start location
+	startcont = startcont + nfcore * PAGE_SIZE;
+	num = num - nfcore;
+
+	KASSERT(coremap != NULL);
+	// initialize core map
+	spinlock_acquire(&coremap_lock);
+	for(int i = 0; i < CM_MAXORDER; i++){
+		freelists[i] = CM_NOFRAME;
+		freeblocks[i] = 0;
+	}
+	freepages = 0;
+	for(int i = 0; i < num; i++){
+		coremap[i].cm_next = CM_NOFRAME;
+		coremap[i].cm_prev = CM_NOFRAME;
+		coremap[i].cm_npages = 0;
+		coremap[i].cm_refcount = 0;
+		coremap[i].cm_order = 0;
+		coremap[i].cm_free = 0;
+		coremap[i].cm_state = CM_FREE;
+		coremap[i].cm_dirty = 0;
+		coremap[i].cm_merged = 0;
+		coremap[i].cm_as = NULL;
+		coremap[i].cm_vpn = 0;
+	}
+	clock_hand = CM_NOFRAME;
+	lru_count = 0;
+	asid_bootstrap();
+	buddy_free_range(0, num);
+	spinlock_release(&coremap_lock);
+
+	vmstats_init();
+
+	// flag vmboost done
+	comp = 1;
+
+	pagecache_bootstrap();
+	swap_bootstrap();
+#endif
+	/* Do nothing. */
+}
+
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+
+#if OPT_A3
+	if(comp){
+		vaddr_t kva = alloc_kpages(npages);
+		if(kva == 0){
+			return 0;
+		}
+		addr = kva - MIPS_KSEG0;
+	} else {
+		spinlock_acquire(&stealmem_lock);
+
+		addr = ram_stealmem(npages);
+	
+		spinlock_release(&stealmem_lock);
+	}
+#else
+	spinlock_acquire(&stealmem_lock);
+
+	addr = ram_stealmem(npages);
+	
+	spinlock_release(&stealmem_lock);
+#endif
+	return addr;
+}
+
+#if OPT_A3
+/* evictions tried per page wanted before alloc_kpages gives up */
+#define EVICT_TRIES     4
+
+static int vm_evict(void);
+
+/*
+ * Mark the NPAGES frames from FRAME on as being in STATE. Whoever has
+ * just allocated or is about to free them owns them, so no lock.
+ */
+static
+void
+coremap_setstate(int frame, int npages, unsigned state)
+{
+	int i;
+
+	for (i = 0; i < npages; i++) {
+		coremap[frame + i].cm_state = state;
+		coremap[frame + i].cm_kmref = NULL;
+	}
+}
+
+/*
+ * Take NPAGES contiguous frames from what is free right now.
+ */
+static
+int
+coremap_alloc(int npages)
+{
+	int frame;
+
+	if(npages == 1){
+		frame = pagemag_alloc();
+		if(frame == CM_NOFRAME){
+			/* zeroed already, which does no harm */
+			frame = zeropool_take(false);
+		}
+		return frame;
+	}
+
+	int spl = splhigh();
+
+	spinlock_acquire(&coremap_lock);
+	frame = buddy_alloc(npages);
+	if(frame == CM_NOFRAME){
+		/*
+		 * Our own cached frames may be what is
+		 * keeping a large enough block apart.
+		 */
+		struct pagemag *mag = &pagemags[curcpu->c_number];
+		pagemag_drain(mag, mag->pm_count);
+		frame = buddy_alloc(npages);
+	}
+	spinlock_release(&coremap_lock);
+
+	if(frame == CM_NOFRAME && zp_count > 0){
+		/* ...and so may the zeroed ones */
+		zeropool_trim(0);
+		spinlock_acquire(&coremap_lock);
+		frame = buddy_alloc(npages);
+		spinlock_release(&coremap_lock);
+	}
+
+	splx(spl);
+	return frame;
+}
+#endif
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+#if OPT_A3
+	if(comp){
+		int frame, tries;
+		if(npages <= 0) return 0;
+
+		KASSERT(coremap != NULL);
+
+		frame = coremap_alloc(npages);
+
+		/*
+		 * Out of memory: page user pages out and try again. Each
+		 * eviction frees one frame, so a multi-page request can
+		 * take several, and may still fail if the frames that come
+		 * free aren't next to each other.
+		 */
+		for(tries = 0; frame == CM_NOFRAME &&
+			    tries < npages * EVICT_TRIES; tries++){
+			if(vm_evict()){
+				break;
+			}
+			frame = coremap_alloc(npages);
+		}
+
+		/*
+		 * Last resort: whatever the object caches are holding,
+		 * and then the kmalloc magazines, where the objects the
+		 * caches let go of end up.
+		 */
+		if(frame == CM_NOFRAME){
+			kmem_cache_reap();
+			kmag_reap();
+			frame = coremap_alloc(npages);
+		}
+
+		if(frame == CM_NOFRAME){
+			return 0;
+		}
+		coremap_setstate(frame, npages, CM_KERNEL);
+		pa = startcont + frame * PAGE_SIZE;
+		return PADDR_TO_KVADDR(pa);
+	}
+#endif
+	pa = getppages(npages);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+#if OPT_A3
+/*
+ * Allocate one kernel page full of zeros, from the pre-zeroed pool if
+ * it has one.
+ */
+vaddr_t
+alloc_kpage_zeroed(void)
+{
+	vaddr_t kva;
+	int frame;
+
+	frame = zeropool_take(true);
+	if (frame != CM_NOFRAME) {
+		coremap_setstate(frame, 1, CM_KERNEL);
+		return PADDR_TO_KVADDR(startcont + frame * PAGE_SIZE);
+	}
+
+	kva = alloc_kpages(1);
+	if (kva != 0) {
+		bzero((void *)kva, PAGE_SIZE);
+	}
+	return kva;
+}
+#endif
+
+void 
+free_kpages(vaddr_t addr)
+{
+	/* nothing - leak the memory. */
+#if OPT_A3
+	paddr_t pad = addr - MIPS_KSEG0; // later
+
+	if(pad < startcont){
+		/* stolen before vm_bootstrap; never managed, so leak it */
+		return;
+	}
+
+	// start from where to free
+	int nthframe = (pad - startcont) / PAGE_SIZE;
+
+	// length need to free
+	KASSERT(coremap != NULL);
+	KASSERT(nthframe < num);
+	KASSERT(!coremap[nthframe].cm_free);
+	KASSERT(coremap[nthframe].cm_state == CM_KERNEL);
+
+	/* we own the block, so its length can't change under us */
+	int x = coremap[nthframe].cm_npages;
+	KASSERT(x > 0);
+	coremap_setstate(nthframe, x, CM_FREE);
+
+	if(x == 1){
+		pagemag_free(nthframe);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	coremap[nthframe].cm_npages = 0;
+
+	// free
+	buddy_free_range(nthframe, x);
+
+	spinlock_release(&coremap_lock);
+#else
+	(void)addr;
+#endif
+}
+
+#if OPT_A3
+/*
+ * kmalloc's record of a page it has carved into blocks, kept in the
+ * page's coremap entry so that kfree can find it without searching.
+ * The page belongs to kmalloc, so nobody else touches the field.
+ * kpage_getref returns false for pages stolen before vm_bootstrap,
+ * which the coremap knows nothing about.
+ */
+void
+kpage_setref(vaddr_t kva, void *ref)
+{
+	paddr_t pa = KVADDR_TO_PADDR(kva);
+	int frame;
+
+	if (!comp || pa < startcont) {
+		return;
+	}
+	frame = get_frame_num(pa);
+	KASSERT(frame < num);
+	KASSERT(coremap[frame].cm_state == CM_KERNEL);
+	coremap[frame].cm_kmref = ref;
+}
+
+bool
+kpage_getref(vaddr_t kva, void **ref)
+{
+	paddr_t pa = KVADDR_TO_PADDR(kva);
+	int frame;
+
+	if (!comp || pa < startcont) {
+		return false;
+	}
+	frame = get_frame_num(pa);
+	KASSERT(frame < num);
+	KASSERT(coremap[frame].cm_state == CM_KERNEL);
+	*ref = coremap[frame].cm_kmref;
+	return true;
+}
+#endif
+
+#if OPT_A3
+/*
+ * Reference counting for user pages.
+ *
+ * upage_alloc hands back a frame with one reference and no owner, so
+ * the clock leaves it alone until upage_setowner publishes it; with
+ * ZERO set, the frame is zero-filled (from the pre-zeroed pool if it
+ * can be).
+ * upage_share adds a mapping (and makes the frame unevictable);
+ * upage_release drops one and frees the frame with the last.
+ * upage_disown takes a page away from the clock, and upage_owner
+ * says who it belongs to, if anyone.
+ * upage_refcount is a snapshot and only meaningful to a caller that
+ * holds a reference itself.
+ *
+ * DIRTY on a user page means the frame holds the only copy of its
+ * contents. A clean page is one vm_fill_page could make again -- it
+ * is mapped read-only until it is first written -- so the page-out
+ * code can just drop it.
+ */
+static
+paddr_t
+upage_alloc(bool zero)
+{
+	vaddr_t kva;
+	int frame;
+
+	kva = zero ? alloc_kpage_zeroed() : alloc_kpages(1);
+	if (kva == 0) {
+		return 0;
+	}
+	frame = get_frame_num(kva - MIPS_KSEG0);
+	KASSERT(coremap[frame].cm_state == CM_KERNEL);
+	KASSERT(coremap[frame].cm_refcount == 0);
+	coremap[frame].cm_state = CM_USER;
+	coremap[frame].cm_refcount = 1;
+	coremap[frame].cm_as = NULL;
+	coremap[frame].cm_dirty = 1;
+	return kva - MIPS_KSEG0;
+}
+
+/*
+ * Put FRAME on the LRU list, just behind the clock hand, so that it
+ * is the last page the hand comes to. Caller holds coremap_lock.
+ */
+static
+void
+lru_insert(int frame)
+{
+	int hand = clock_hand;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (hand == CM_NOFRAME) {
+		coremap[frame].cm_next = frame;
+		coremap[frame].cm_prev = frame;
+		clock_hand = frame;
+	}
+	else {
+		coremap[frame].cm_next = hand;
+		coremap[frame].cm_prev = coremap[hand].cm_prev;
+		coremap[coremap[hand].cm_prev].cm_next = frame;
+		coremap[hand].cm_prev = frame;
+	}
+	lru_count++;
+}
+
+/* Caller holds coremap_lock. */
+static
+void
+lru_remove(int frame)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(lru_count > 0);
+
+	if (--lru_count == 0) {
+		clock_hand = CM_NOFRAME;
+		return;
+	}
+	if (clock_hand == frame) {
+		clock_hand = coremap[frame].cm_next;
+	}
+	coremap[coremap[frame].cm_prev].cm_next = coremap[frame].cm_next;
+	coremap[coremap[frame].cm_next].cm_prev = coremap[frame].cm_prev;
+}
+
+/* Caller holds coremap_lock. */
+static
+void
+upage_disown(paddr_t pa)
+{
+	int frame = get_frame_num(pa);
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	if (coremap[frame].cm_state == CM_USER &&
+	    coremap[frame].cm_as != NULL) {
+		lru_remove(frame);
+		coremap[frame].cm_as = NULL;
+	}
+}
+
+/* Caller holds coremap_lock. */
+static
+void
+upage_share(paddr_t pa)
+{
+	int frame = get_frame_num(pa);
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap[frame].cm_refcount > 0);
+	coremap[frame].cm_refcount++;
+	upage_disown(pa);
+}
+
+/*
+ * Make AS the owner of PA, which it maps at VADDR, and hand the page
+ * to the clock. Caller holds coremap_lock.
+ */
+static
+void
+upage_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr)
+{
+	int frame = get_frame_num(pa);
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap[frame].cm_state == CM_USER);
+	KASSERT(coremap[frame].cm_refcount == 1);
+	if (coremap[frame].cm_as == NULL) {
+		lru_insert(frame);
+	}
+	coremap[frame].cm_merged = 0;
+	coremap[frame].cm_as = as;
+	coremap[frame].cm_vpn = vaddr / PAGE_SIZE;
+}
+
+/* Caller holds coremap_lock. */
+static
+struct addrspace *
+upage_owner(paddr_t pa)
+{
+	int frame = get_frame_num(pa);
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	return coremap[frame].cm_state == CM_USER ? coremap[frame].cm_as : NULL;
+}
+
+/* Caller holds coremap_lock. */
+static
+void
+upage_setdirty(paddr_t pa, bool dirty)
+{
+	int frame = get_frame_num(pa);
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(coremap[frame].cm_state == CM_USER);
+	coremap[frame].cm_dirty = dirty;
+}
+
+static struct textpage *text_unhash(int frame);
+
+static
+void
+upage_release(paddr_t pa)
+{
+	int frame = get_frame_num(pa);
+	struct textpage *tp = NULL;
+	unsigned left;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[frame].cm_refcount > 0);
+	left = --coremap[frame].cm_refcount;
+	if (left == 0) {
+		upage_disown(pa);
+		tp = text_unhash(frame);
+		coremap[frame].cm_merged = 0;
+		coremap[frame].cm_state = CM_KERNEL;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (left == 0) {
+		free_kpages(PADDR_TO_KVADDR(pa));
+	}
+	if (tp != NULL) {
+		kfree(tp);
+	}
+}
+
+static
+unsigned
+upage_refcount(paddr_t pa)
+{
+	return coremap[get_frame_num(pa)].cm_refcount;
+}
+
+/*
+ * Shared program text.
+ *
+ * A page of a program that no region lets it write is the same in
+ * every process running that program, so it only needs reading in
+ * once: the text cache maps (program vnode, page address) to a frame
+ * already holding the page, and later faults just take another
+ * reference to it. The cache holds no reference of its own; an entry
+ * goes away when its frame's last mapping does. The vnode can't be
+ * recycled under an entry, since the regions of whoever maps the
+ * frame hold references to it.
+ *
+ * The table and the entries are covered by coremap_lock, so that
+ * looking up a frame and taking a reference to it can't race with
+ * the frame being freed.
+ */
+#define TEXT_HASHSIZE   61
+
+struct textpage {
+	struct vnode *tp_vnode;
+	vaddr_t tp_vaddr;
+	paddr_t tp_paddr;
+	struct textpage *tp_next;
+};
+
+static struct textpage *text_hash[TEXT_HASHSIZE];
+static unsigned text_npages;
+static unsigned text_hits;
+
+/* Caller holds coremap_lock. */
+static
+struct textpage **
+text_find(struct vnode *v, vaddr_t vaddr)
+{
+	struct textpage **tpp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	tpp = &text_hash[((uintptr_t)v / sizeof(void *) + vaddr / PAGE_SIZE)
+			 % TEXT_HASHSIZE];
+	while (*tpp != NULL) {
+		if ((*tpp)->tp_vnode == v && (*tpp)->tp_vaddr == vaddr) {
+			break;
+		}
+		tpp = &(*tpp)->tp_next;
+	}
+	return tpp;
+}
+
+/*
+ * Take the entry for FRAME, whose last reference has just gone, out
+ * of the cache, and hand it back for freeing. Caller holds
+ * coremap_lock.
+ */
+static
+struct textpage *
+text_unhash(int frame)
+{
+	struct textpage *tp, **tpp;
+
+	if (coremap[frame].cm_state != CM_TEXT) {
+		return NULL;
+	}
+	tp = coremap[frame].cm_text;
+	tpp = text_find(tp->tp_vnode, tp->tp_vaddr);
+	KASSERT(*tpp == tp);
+	*tpp = tp->tp_next;
+	coremap[frame].cm_text = NULL;
+	coremap[frame].cm_state = CM_USER;
+	text_npages--;
+	return tp;
+}
+
+/*
+ * Find the frame holding the page at VADDR of the program V, and take
+ * a reference to it. Returns 0 if it isn't cached.
+ */
+static
+paddr_t
+text_lookup(struct vnode *v, vaddr_t vaddr)
+{
+	struct textpage *tp;
+	paddr_t pa = 0;
+
+	spinlock_acquire(&coremap_lock);
+	tp = *text_find(v, vaddr);
+	if (tp != NULL) {
+		pa = tp->tp_paddr;
+		coremap[get_frame_num(pa)].cm_refcount++;
+		text_hits++;
+	}
+	spinlock_release(&coremap_lock);
+	return pa;
+}
+
+/*
+ * Cache the frame PA, which we hold the only reference to, as the
+ * page at VADDR of V. If someone else read the page in meanwhile, let
+ * ours go and hand back theirs, with a reference. If there's no
+ * memory for the entry, the page just isn't shared.
+ */
+static
+paddr_t
+text_insert(struct vnode *v, vaddr_t vaddr, paddr_t pa)
+{
+	struct textpage *tp, **tpp;
+	paddr_t theirs;
+
+	tp = kmalloc(sizeof(struct textpage));
+	if (tp == NULL) {
+		return pa;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	tpp = text_find(v, vaddr);
+	if (*tpp != NULL) {
+		theirs = (*tpp)->tp_paddr;
+		coremap[get_frame_num(theirs)].cm_refcount++;
+		spinlock_release(&coremap_lock);
+		kfree(tp);
+		upage_release(pa);
+		return theirs;
+	}
+	tp->tp_vnode = v;
+	tp->tp_vaddr = vaddr;
+	tp->tp_paddr = pa;
+	tp->tp_next = NULL;
+	*tpp = tp;
+	KASSERT(coremap[get_frame_num(pa)].cm_state == CM_USER);
+	KASSERT(coremap[get_frame_num(pa)].cm_as == NULL);
+	coremap[get_frame_num(pa)].cm_state = CM_TEXT;
+	coremap[get_frame_num(pa)].cm_text = tp;
+	text_npages++;
+	spinlock_release(&coremap_lock);
+	return pa;
+}
+
+/*
+ * Print the buddy free lists. External fragmentation is reported as
+ * the share of free memory that lies outside the largest free block,
+ * i.e. how far we are from being able to satisfy a request for all of
+ * the memory that is nominally free.
+ */
+void
+coremap_printstats(void)
+{
+	unsigned blocks[CM_MAXORDER];
+	unsigned total, largest, frag, cached, owned, states[4];
+	unsigned merged, mergedmaps;
+	struct pagemag *mag;
+	struct asidcpu *ac;
+	unsigned i;
+
+	spinlock_acquire(&coremap_lock);
+	for (i = 0; i < CM_MAXORDER; i++) {
+		blocks[i] = freeblocks[i];
+	}
+	total = freepages;
+	owned = lru_count;
+	for (i = 0; i < 4; i++) {
+		states[i] = 0;
+	}
+	merged = mergedmaps = 0;
+	for (i = 0; i < (unsigned)num; i++) {
+		states[coremap[i].cm_state]++;
+		if (coremap[i].cm_merged) {
+			merged++;
+			mergedmaps += coremap[i].cm_refcount;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	/* magazine counters are only ever approximate from here */
+	cached = 0;
+	for (i = 0; i < MAXCPUS; i++) {
+		cached += pagemags[i].pm_count;
+	}
+
+	largest = 0;
+	for (i = 0; i < CM_MAXORDER; i++) {
+		if (blocks[i] > 0) {
+			largest = 1U << i;
+		}
+	}
+	frag = total == 0 ? 0 : 100 - (largest * 100) / total;
+
+	kprintf("Physical memory: %d frames managed, %d used by coremap\n",
+		num, nfcore);
+	kprintf("coremap: %u bytes per frame, %u.%02u%% of memory\n",
+		sizeof(struct coremap_entry),
+		nfcore * 100 / (num + nfcore),
+		nfcore * 10000 / (num + nfcore) % 100);
+	kprintf("frames: %u free, %u kernel, %u user (%u evictable), "
+		"%u text\n", states[CM_FREE], states[CM_KERNEL],
+		states[CM_USER], owned, states[CM_TEXT]);
+	kprintf("clean pages dropped instead of paged out: %u\n",
+		clean_evictions);
+	kprintf("same-page merging: %u pages hashed, %u merged; "
+		"%u frames stand in for %u pages (%uK saved)\n",
+		merge_scanned, merge_merged, merged, mergedmaps,
+		(mergedmaps - merged) * PAGE_SIZE / 1024);
+	kprintf("order  blocks   pages\n");
+	for (i = 0; i < CM_MAXORDER; i++) {
+		if (blocks[i] == 0) {
+			continue;
+		}
+		kprintf("%5u %7u %7u\n", i, blocks[i], blocks[i] << i);
+	}
+	kprintf("free pages: %u of %d (+%u in magazines), "
+		"largest free block: %u pages\n",
+		total, num, cached, largest);
+	kprintf("external fragmentation: %u%%\n", frag);
+
+	kprintf("cpu   allocs    hit%%    frees  refills   drains\n");
+	for (i = 0; i < MAXCPUS; i++) {
+		mag = &pagemags[i];
+		if (mag->pm_allocs == 0 && mag->pm_frees == 0) {
+			continue;
+		}
+		kprintf("%3u %8u %6u%% %8u %8u %8u\n", i,
+			mag->pm_allocs,
+			mag->pm_allocs ? mag->pm_hits * 100 / mag->pm_allocs : 0,
+			mag->pm_frees, mag->pm_refills, mag->pm_drains);
+	}
+
+	kprintf("cpu activates     same   reused  flushes\n");
+	for (i = 0; i < MAXCPUS; i++) {
+		ac = &asidcpus[i];
+		if (ac->ac_activates == 0) {
+			continue;
+		}
+		kprintf("%3u %9u %8u %8u %8u\n", i, ac->ac_activates,
+			ac->ac_same, ac->ac_reused, ac->ac_flushes);
+	}
+	kprintf("shootdowns: %u batches (%u too big to list); other cpus: "
+		"%u sent IPIs, %u ASIDs retired, %u skipped\n",
+		sd_batches, sd_overflows, sd_ipis, sd_retired, sd_skipped);
+
+	/* unlocked; only a snapshot */
+	kprintf("text: %u pages shared, %u faults found them cached\n",
+		text_npages, text_hits);
+	kprintf("zero pool: %u of %u-%u pages; %u hits, %u misses, "
+		"%u zeroed idle, %u reclaimed\n",
+		zp_count, zp_low, zp_high, zp_hits, zp_misses,
+		zp_zeroed, zp_reclaimed);
+
+	swap_printstats();
+	pagecache_printstats();
+}
+#endif
+
+/*
+ * Shootdowns sent by tlbbatch_flush, on the CPU that gets them, with
+ * interrupts off. Only the address space this CPU is running matters;
+ * any other one has had its ASID here retired.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+#if OPT_A3
+	tlb_flush();
+#else
+	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+#if OPT_A3
+	struct asidcpu *ac = &asidcpus[curcpu->c_number];
+	int i;
+
+	if (ts->ts_addrspace != ac->ac_lastas) {
+		return;
+	}
+	i = tlb_probe(ts->ts_vaddr | (ac->ac_pid << TLBHI_PIDSHIFT), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setpid(ac->ac_pid);
+#else
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
+}
+
+#if OPT_A3
+
+// helper functions for page///////////////////////////////////////////////
+unsigned int
+get_page_num(vaddr_t vad, vaddr_t vbase){
+	return (vad - vbase) / PAGE_SIZE;
+}
+
+paddr_t
+get_page_offset(vaddr_t vad, vaddr_t vbase){
+	return (paddr_t)(vad - vbase) % PAGE_SIZE;
+}
+
+unsigned int
+get_frame_num(paddr_t pad){
+	return (unsigned int)(pad - startcont)/PAGE_SIZE;;
+}
+
+paddr_t
+get_paddr(unsigned int i){
+	return i * PAGE_SIZE + startcont;
+}
+
+/*
+ * Page table entries.
+ *
+ * The segment page tables hold one entry per page in the same layout
+ * as TLBLO: the physical page in the top bits, TLBLO_VALID set once a
+ * frame has been attached, and TLBLO_DIRTY set if the page may be
+ * written right now. An entry of 0 is a page that has never been
+ * touched; vm_fault allocates and zero-fills it on first use.
+ *
+ * The low bits, which the TLB ignores, are ours. PTE_COW marks a
+ * writeable page whose frame may be shared with another address
+ * space; it is mapped read-only until the first write copies it.
+ * PTE_SWAPPED marks a page that has been paged out; such an entry
+ * is not VALID and holds the swap slot where the frame number would
+ * be. PTE_REF is the clock's reference bit; it is only ever set on
+ * resident pages, which is all the fast refill handler in
+ * exception-mips1.S checks before loading an entry into the TLB.
+ * PTE_FILE marks a page of a mapped file, whose frame belongs to the
+ * page cache rather than the address space; such pages are never
+ * copy-on-write or paged out.
+ *
+ * Once a page has been touched its entry only moves between resident
+ * and swapped under coremap_lock, since the page-out code rewrites
+ * entries of address spaces other than the current one.
+ */
+#define PTE_COW           0x00000001
+#define PTE_SWAPPED       0x00000002
+#define PTE_REF           0x00000004	/* known to exception-mips1.S */
+#define PTE_FILE          0x00000008
+#define PTE_SWBITS        0x000000ff
+#define PTE_PADDR(pte)    ((paddr_t)(pte) & TLBLO_PPAGE)
+#define PTE_RESIDENT(pte) (((pte) & TLBLO_VALID) != 0)
+#define PTE_MAKE(pa)      (((pa) & TLBLO_PPAGE) | TLBLO_VALID)
+#define PTE_TLBLO(pte)    ((uint32_t)(pte) & ~(uint32_t)PTE_SWBITS)
+#define PTE_ONSWAP(pte)   (((pte) & PTE_SWAPPED) != 0)
+#define PTE_SWAPSLOT(pte) ((unsigned)(pte) >> 12)
+#define PTE_MAKESWAP(slot) (((slot) << 12) | PTE_SWAPPED)
+
+/*
+ * Page tables.
+ *
+ * A virtual address splits 10/10/12: the top ten bits pick a slot in
+ * the address space's page directory, the next ten an entry in the
+ * second-level table that slot points to. Only user space (below
+ * USERSPACETOP) has directory slots, and a second-level table is only
+ * allocated once an address in its 4M is faulted on, so a sparse
+ * address space costs little more than the pages it actually uses.
+ *
+ * Second-level tables are only ever added by the thread that owns the
+ * address space, and only freed by as_destroy, so the page-out code
+ * can walk another address space's tables under coremap_lock.
+ */
+#define PT_PAGEBITS     12
+#define PT_L2BITS       10
+#define PT_L2SIZE       (1 << PT_L2BITS)
+#define PT_L1SIZE       (USERSPACETOP >> (PT_PAGEBITS + PT_L2BITS))
+#define PT_L1INDEX(va)  ((va) >> (PT_PAGEBITS + PT_L2BITS))
+#define PT_L2INDEX(va)  (((va) >> PT_PAGEBITS) & (PT_L2SIZE - 1))
+#define PT_VADDR(i, j)  (((vaddr_t)(i) << (PT_PAGEBITS + PT_L2BITS)) | \
+			 ((vaddr_t)(j) << PT_PAGEBITS))
+
+#if PT_L2SIZE * 4 != PAGE_SIZE
+#error "Second-level page tables are expected to fill a page"
+#endif
+
+/*
+ * Find the page table entry for VADDR. If its second-level table
+ * doesn't exist yet, make one when CREATE is set; otherwise, or if
+ * there is no memory for it, return NULL.
+ */
+static
+unsigned int *
+as_lookup_pte(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+	unsigned int *pt;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	pt = as->as_pgdir[PT_L1INDEX(vaddr)];
+	if (pt == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		/* a second-level table is exactly one page */
+		pt = (unsigned int *)alloc_kpage_zeroed();
+		if (pt == NULL) {
+			return NULL;
+		}
+		as->as_pgdir[PT_L1INDEX(vaddr)] = pt;
+	}
+	return &pt[PT_L2INDEX(vaddr)];
+}
+
+/*
+ * Resident set accounting: AS maps N more frames (or fewer, if N is
+ * negative). Every page table entry becomes or stops being resident
+ * under coremap_lock, so that is what covers the count too.
+ */
+static
+void
+as_rss_add(struct addrspace *as, int n)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	as->as_rss += n;
+	if (as->as_rss > as->as_maxrss) {
+		as->as_maxrss = as->as_rss;
+	}
+}
+
+/*
+ * Find the region of AS that VADDR lies in, or NULL if there is none.
+ */
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vaddr < rg->rg_vbase) {
+			/* sorted, so nothing further on can match */
+			break;
+		}
+		if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a region to AS, keeping the list sorted. If RET isn't NULL, the
+ * new region is handed back through it.
+ */
+static
+int
+as_add_region(struct addrspace *as, vaddr_t vbase, size_t npages, int perms,
+	      struct region **ret)
+{
+	struct region *rg, **prev;
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vbase;
+	rg->rg_npages = npages;
+	rg->rg_perms = perms;
+	rg->rg_vnode = NULL;
+	rg->rg_offset = 0;
+	rg->rg_elf = NULL;
+	rg->rg_elfvaddr = 0;
+	rg->rg_elfoffset = 0;
+	rg->rg_elfsize = 0;
+
+	for (prev = &as->as_regions; *prev != NULL; prev = &(*prev)->rg_next) {
+		if ((*prev)->rg_vbase > vbase) {
+			break;
+		}
+	}
+	rg->rg_next = *prev;
+	*prev = rg;
+	if (ret != NULL) {
+		*ret = rg;
+	}
+	return 0;
+}
+
+/*
+ * Grow the stack of AS down to cover VADDR, which lies below it. SP
+ * is the user stack pointer (the faulting thread's t_usersp).
+ *
+ * The stack may grow to as_stackmax pages, and the page below it is
+ * always left unmapped as a guard: a fault beyond the limit, or one
+ * that would bring the stack within a page of the region below it,
+ * is a stack overflow and gets EFAULT. So is a fault more than
+ * STACK_SLACK below the user's stack pointer, which is a stray
+ * pointer rather than the stack. Growing only moves the region
+ * boundary; the pages themselves are demand-zero like any other.
+ */
+static
+int
+as_grow_stack(struct addrspace *as, vaddr_t vaddr, vaddr_t sp)
+{
+	struct region *stack = as->as_stack;
+	struct region *rg;
+	vaddr_t newbase;
+
+	if (stack == NULL || vaddr >= stack->rg_vbase) {
+		return EFAULT;
+	}
+	/* VADDR is a page; the access may be anywhere on it */
+	if (vaddr < ((sp - STACK_SLACK) & PAGE_FRAME)) {
+		return EFAULT;
+	}
+
+	newbase = vaddr & PAGE_FRAME;
+	if (USERSTACK - newbase > as->as_stackmax * PAGE_SIZE) {
+		return EFAULT;
+	}
+
+	/* regions are sorted, so everything before the stack is below it */
+	for (rg = as->as_regions; rg != stack; rg = rg->rg_next) {
+		if (rg->rg_vbase + (rg->rg_npages + 1) * PAGE_SIZE > newbase) {
+			return EFAULT;
+		}
+	}
+
+	stack->rg_vbase = newbase;
+	stack->rg_npages = (USERSTACK - newbase) / PAGE_SIZE;
+	return 0;
+}
+
+/*
+ * Load a translation for the current address space AS into the TLB,
+ * preferring an unused slot. Every TLB miss we service ends up here,
+ * so this is where it is counted.
+ */
+static
+void
+tlb_insert(struct addrspace *as, vaddr_t vaddr, uint32_t elo)
+{
+	uint32_t ehi, hi, lo;
+	int i, spl;
+
+	vmstats_inc(VMSTAT_TLB_FAULT);
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	/* tlb_write leaves ehi, and so our PID, in c0_entryhi */
+	ehi = vaddr | asid_tlbhi(as);
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&hi, &lo, i);
+		if (lo & TLBLO_VALID) {
+			continue;
+		}
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", ehi, elo);
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		return;
+	}
+
+	tlb_random(ehi, elo);
+	splx(spl);
+	vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+}
+
+/*
+ * Load a translation the current address space AS is expected to want
+ * soon, unless the TLB has one already. This isn't a miss, so it isn't
+ * counted as one. Returns true if the entry was loaded.
+ */
+static
+bool
+tlb_prefill(struct addrspace *as, vaddr_t vaddr, uint32_t elo)
+{
+	uint32_t ehi, hi, lo;
+	int i, spl;
+
+	spl = splhigh();
+	ehi = vaddr | asid_tlbhi(as);
+	if (tlb_probe(ehi, 0) >= 0) {
+		splx(spl);
+		return false;
+	}
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&hi, &lo, i);
+		if (lo & TLBLO_VALID) {
+			continue;
+		}
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return true;
+	}
+	tlb_random(ehi, elo);
+	splx(spl);
+	return true;
+}
+
+/*
+ * Replace the translation for VADDR in the current address space AS
+ * if the TLB holds one.
+ *
+ * This only reaches this CPU's TLB, and since ASIDs outlive context
+ * switches, other CPUs can still hold the old entry. That is harmless
+ * when only the permissions grow (they fault and reload), so that is
+ * all this is for: a page that moves to another frame has to be shot
+ * down everywhere with a tlbbatch instead.
+ */
+static
+void
+tlb_update(struct addrspace *as, vaddr_t vaddr, uint32_t elo)
+{
+	uint32_t ehi, oldehi, oldelo;
+	int i, spl;
+
+	spl = splhigh();
+	ehi = vaddr | asid_tlbhi(as);
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_read(&oldehi, &oldelo, i);
+		KASSERT((oldelo & TLBLO_PPAGE) == (elo & TLBLO_PPAGE));
+		tlb_write(ehi, elo, i);
+	}
+	splx(spl);
+}
+
+/*
+ * Drop the translation for VADDR in AS, which need not be the current
+ * address space, from this CPU's TLB.
+ */
+static
+void
+tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	int i, spl;
+
+	spl = splhigh();
+	if (asid_live(as)) {
+		i = tlb_probe(vaddr | asid_tlbhi(as), 0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		tlb_setpid(asidcpus[curcpu->c_number].ac_pid);
+	}
+	splx(spl);
+}
+
+/*
+ * May user code write to VADDR? Anything goes while the program is
+ * being loaded; after that, only regions defined writeable. Regions
+ * can share a page at their ends, and such a page is writeable if
+ * either of them is.
+ *
+ * The MIPS TLB can't take away read or execute permission on its
+ * own, so RG_READ and RG_EXEC are recorded but not enforced.
+ */
+static
+bool
+as_writeable(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+
+	if (!as->flag) {
+		return true;
+	}
+	for (rg = as->as_regions; rg != NULL && rg->rg_vbase <= vaddr;
+	     rg = rg->rg_next) {
+		if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+		    (rg->rg_perms & RG_WRITE)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Point PTE (for VADDR in AS) at the frame PA, which we hold the only
+ * reference to, and hand the frame to the clock. If LOAD is set, the
+ * translation goes into the TLB as well. A clean page (DIRTY unset)
+ * is mapped read-only until it is written.
+ */
+static
+void
+vm_map_page(struct addrspace *as, unsigned int *pte, vaddr_t vaddr,
+	    paddr_t pa, bool load, bool dirty)
+{
+	unsigned int newpte;
+
+	newpte = PTE_MAKE(pa) | PTE_REF;
+	if (dirty && as_writeable(as, vaddr)) {
+		newpte |= TLBLO_DIRTY;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	*pte = newpte;
+	as_rss_add(as, 1);
+	upage_setdirty(pa, dirty);
+	upage_setowner(pa, as, vaddr);
+	if (load) {
+		tlb_insert(as, vaddr, PTE_TLBLO(newpte));
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Can the current thread wait for swap I/O?
+ */
+static
+bool
+vm_can_sleep(void)
+{
+	return curthread != NULL && !curthread->t_in_interrupt &&
+		curthread->t_iplhigh_count == 0;
+}
+
+/*
+ * Clock (second-chance) page replacement.
+ *
+ * The hand goes round the LRU list, which holds just the pages that
+ * have an owner. A page that has been used since the hand last passed
+ * it loses its PTE_REF bit and is skipped; the first one that hasn't
+ * is the victim. The MIPS TLB keeps no reference bits, so vm_fault
+ * sets ours whenever it loads a page, and clearing it here also drops
+ * the page from the TLB so that the next use faults and sets it again
+ * (the fast refill path leaves pages without PTE_REF to vm_fault).
+ * The bit lives in the page table entry rather than the coremap
+ * because the refill handler has to see it. Other CPUs aren't told;
+ * a page they keep using from their TLBs only looks idle, which is
+ * not worth an IPI.
+ */
+static
+int
+clock_select(void)
+{
+	struct addrspace *as;
+	unsigned int *pte;
+	vaddr_t vaddr;
+	unsigned i;
+	int frame;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (i = 0; i < 2 * lru_count; i++) {
+		frame = clock_hand;
+		clock_hand = coremap[frame].cm_next;
+
+		KASSERT(coremap[frame].cm_state == CM_USER);
+		KASSERT(coremap[frame].cm_refcount == 1);
+		as = coremap[frame].cm_as;
+		vaddr = coremap[frame].cm_vpn * PAGE_SIZE;
+		pte = as_lookup_pte(as, vaddr, false);
+		KASSERT(pte != NULL && PTE_RESIDENT(*pte));
+		if (*pte & PTE_REF) {
+			*pte &= ~PTE_REF;
+			tlb_invalidate(as, vaddr);
+			continue;
+		}
+		return frame;
+	}
+	return CM_NOFRAME;
+}
+
+/*
+ * Page one user page out to swap and free its frame. Returns 0 if a
+ * frame was freed.
+ *
+ * swap_lock is held from the moment the page is unmapped until it is
+ * on disk, so if its owner faults on it meanwhile the page-in waits
+ * and reads back what we wrote.
+ *
+ * A clean page isn't written out at all: its entry goes back to
+ * untouched, and the next fault makes it again.
+ *
+ * The page is shot down on every CPU before it is written out, so
+ * that nobody can change it behind our back.
+ */
+static
+int
+vm_evict(void)
+{
+	struct addrspace *as;
+	unsigned int *pte, oldpte;
+	struct tlbbatch tb;
+	unsigned slot;
+	vaddr_t vaddr;
+	paddr_t pa;
+	int frame, result;
+	bool havelock, dirty;
+
+	if (!swap_enabled() || !vm_can_sleep()) {
+		return ENOMEM;
+	}
+
+	/* a page-in that needs a frame already holds the lock */
+	havelock = lock_do_i_hold(swap_lock);
+	if (!havelock) {
+		lock_acquire(swap_lock);
+	}
+
+	result = swap_alloc(&slot);
+	if (result) {
+		goto done;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	frame = clock_select();
+	if (frame == CM_NOFRAME) {
+		spinlock_release(&coremap_lock);
+		swap_free(slot);
+		result = ENOMEM;
+		goto done;
+	}
+
+	as = coremap[frame].cm_as;
+	vaddr = coremap[frame].cm_vpn * PAGE_SIZE;
+	dirty = coremap[frame].cm_dirty;
+	pte = as_lookup_pte(as, vaddr, false);
+	KASSERT(pte != NULL && PTE_RESIDENT(*pte));
+	KASSERT(get_frame_num(PTE_PADDR(*pte)) == (unsigned)frame);
+
+	oldpte = *pte;
+	pa = PTE_PADDR(oldpte);
+	*pte = dirty ? PTE_MAKESWAP(slot) : 0;
+	as_rss_add(as, -1);
+	upage_disown(pa);
+	spinlock_release(&coremap_lock);
+
+	/* AS can't go away while we hold swap_lock */
+	tlbbatch_init(&tb, as);
+	tlbbatch_add(&tb, vaddr);
+	tlbbatch_flush(&tb);
+
+	if (!dirty) {
+		swap_free(slot);
+		upage_release(pa);
+		clean_evictions++;
+		goto done;
+	}
+
+	result = swap_pageout(slot, pa);
+	if (result) {
+		/* Put it back. AS can't go away while we hold swap_lock. */
+		spinlock_acquire(&coremap_lock);
+		*pte = oldpte;
+		as_rss_add(as, 1);
+		upage_setowner(pa, as, vaddr);
+		spinlock_release(&coremap_lock);
+		swap_free(slot);
+		goto done;
+	}
+
+	upage_release(pa);
+
+ done:
+	if (!havelock) {
+		lock_release(swap_lock);
+	}
+	return result;
+}
+
+/*
+ * Bring a swapped-out page back in.
+ */
+static
+int
+vm_swapin(struct addrspace *as, unsigned int *pte, vaddr_t faultaddress)
+{
+	unsigned slot;
+	paddr_t pa;
+	bool fromdisk;
+	int result;
+
+	lock_acquire(swap_lock);
+
+	/* only we page our own pages in */
+	KASSERT(PTE_ONSWAP(*pte));
+	slot = PTE_SWAPSLOT(*pte);
+
+	pa = upage_alloc(false);
+	if (pa == 0) {
+		lock_release(swap_lock);
+		return ENOMEM;
+	}
+	result = swap_pagein(slot, pa, &fromdisk);
+	if (result) {
+		upage_release(pa);
+		lock_release(swap_lock);
+		return result;
+	}
+	swap_free(slot);
+	vm_map_page(as, pte, faultaddress, pa, true, true);
+
+	lock_release(swap_lock);
+
+	if (fromdisk) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		curproc->p_majflt++;
+	}
+	else {
+		/* decompressed from the pool */
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
+	return 0;
+}
+
+/*
+ * Write to a copy-on-write page. If someone else still maps the
+ * frame, give this address space its own copy; if we turn out to be
+ * the last user, just take the frame over. Either way the page ends
+ * up with a single owner and becomes evictable again.
+ */
+static
+int
+vm_cow_fault(struct addrspace *as, unsigned int *pte, vaddr_t faultaddress)
+{
+	struct tlbbatch tb;
+	paddr_t oldpa, newpa;
+
+	/* shared pages have no owner, so this can't be paged out */
+	oldpa = PTE_PADDR(*pte);
+
+	if (upage_refcount(oldpa) > 1) {
+		/*
+		 * Copy without holding anything: every mapping of the
+		 * old frame is read-only, and our reference keeps it
+		 * from being freed.
+		 */
+		newpa = upage_alloc(false);
+		if (newpa == 0) {
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(newpa),
+			(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+
+		spinlock_acquire(&coremap_lock);
+		*pte = PTE_MAKE(newpa) | TLBLO_DIRTY | PTE_REF;
+		upage_setdirty(newpa, true);
+		upage_setowner(newpa, as, faultaddress);
+		spinlock_release(&coremap_lock);
+
+		/*
+		 * Other CPUs may still map the old frame for us, and
+		 * would go on reading it after we move there. Drop
+		 * those before letting the frame go; the next touch
+		 * here loads the new one.
+		 */
+		tlbbatch_init(&tb, as);
+		tlbbatch_add(&tb, faultaddress);
+		tlbbatch_flush(&tb);
+
+		upage_release(oldpa);
+		return 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	*pte = (*pte & ~PTE_COW) | TLBLO_DIRTY | PTE_REF;
+	upage_setdirty(oldpa, true);
+	upage_setowner(oldpa, as, faultaddress);
+	tlb_update(as, faultaddress, PTE_TLBLO(*pte));
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+/*
+ * Same-page merging.
+ *
+ * Forked processes, and processes running the same program, end up
+ * with many frames that hold byte-for-byte the same thing: zeroed
+ * BSS and heap, and data pages nobody has changed since as_copy. A
+ * background thread (vm_mergestart) looks for such twins and folds
+ * them into one shared frame, which from then on behaves just like a
+ * frame shared by fork: it has no owner, every mapping of it is
+ * read-only, and the first write to it goes through vm_cow_fault.
+ *
+ * Once a second the thread hashes the next merge_rate frames that
+ * have an owner, and looks the hash up in a small direct-mapped
+ * table that remembers one frame per bucket. Pages that hash alike
+ * are compared in full and merged if they really are the same; any
+ * other page just takes over the bucket. The table is lossy, so
+ * twins are only found if they come round close enough together,
+ * which is true of the pages of two copies of one program.
+ *
+ * A page is write-protected (and shot down) before it is compared,
+ * so that whether it has been written since shows in its page table
+ * entry: if TLBLO_DIRTY is back, or the page has changed hands, the
+ * merge is called off. Frames made by merging are marked cm_merged
+ * and stay in the table, so later twins are merged into them too.
+ *
+ * merge_lock is held while looking at a page, and as_destroy waits
+ * for it, so the address spaces involved stay around.
+ *
+ * Write-protecting pages costs faults and shootdowns whether or not
+ * anything turns out to be mergeable, so the thread starts out idle;
+ * the "sm" menu command (vm_setmerge) sets it going.
+ */
+#define MERGE_TABLESIZE 512
+
+struct mergeslot {
+	uint32_t ms_hash;
+	int ms_frame;		/* or CM_NOFRAME */
+};
+
+static struct lock *merge_lock;
+static struct mergeslot merge_table[MERGE_TABLESIZE];
+static unsigned merge_cursor;	/* next frame to look at */
+static unsigned merge_rate = 0; /* frames per second; 0: off */
+
+static
+uint32_t
+merge_hash(paddr_t pa)
+{
+	const uint32_t *p = (const uint32_t *)PADDR_TO_KVADDR(pa);
+	uint32_t h = 2166136261U;
+	unsigned i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		h = (h ^ p[i]) * 16777619U;
+	}
+	return h;
+}
+
+static
+bool
+merge_same(paddr_t pa1, paddr_t pa2)
+{
+	const uint32_t *p1 = (const uint32_t *)PADDR_TO_KVADDR(pa1);
+	const uint32_t *p2 = (const uint32_t *)PADDR_TO_KVADDR(pa2);
+	unsigned i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (p1[i] != p2[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Find the page table entry through which AS maps FRAME at VADDR, or
+ * NULL if it doesn't any more. Caller holds coremap_lock.
+ */
+static
+unsigned int *
+merge_lookup(int frame, struct addrspace *as, vaddr_t vaddr)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (coremap[frame].cm_state != CM_USER ||
+	    coremap[frame].cm_as != as ||
+	    coremap[frame].cm_vpn != vaddr / PAGE_SIZE) {
+		return NULL;
+	}
+	return as_lookup_pte(as, vaddr, false);
+}
+
+/*
+ * Merge the owned page FRAME into TARGET, which is either another
+ * owned page or an earlier merged frame, if the two are the same.
+ * Returns true if FRAME was freed. Caller holds merge_lock.
+ */
+static
+bool
+merge_pages(int target, int frame)
+{
+	struct addrspace *as, *tas;
+	vaddr_t vaddr, tvaddr;
+	unsigned int *pte, *tpte;
+	struct tlbbatch tb;
+	paddr_t pa, tpa;
+	bool same;
+
+	KASSERT(lock_do_i_hold(merge_lock));
+
+	pa = get_paddr(frame);
+	tpa = get_paddr(target);
+
+	/* write-protect both, unless the target is merged already */
+	spinlock_acquire(&coremap_lock);
+	as = upage_owner(pa);
+	if (as == NULL || coremap[target].cm_state != CM_USER ||
+	    coremap[target].cm_refcount == 0xffff /* would overflow */) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	vaddr = coremap[frame].cm_vpn * PAGE_SIZE;
+	tas = coremap[target].cm_as;
+	tvaddr = coremap[target].cm_vpn * PAGE_SIZE;
+	if (tas == NULL && !coremap[target].cm_merged) {
+		/* shared, but not by us; leave it alone */
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	pte = as_lookup_pte(as, vaddr, false);
+	*pte &= ~TLBLO_DIRTY;
+	if (tas != NULL) {
+		tpte = as_lookup_pte(tas, tvaddr, false);
+		*tpte &= ~TLBLO_DIRTY;
+	}
+	spinlock_release(&coremap_lock);
+
+	tlbbatch_init(&tb, as);
+	tlbbatch_add(&tb, vaddr);
+	if (tas == as) {
+		tlbbatch_add(&tb, tvaddr);
+	}
+	tlbbatch_flush(&tb);
+	if (tas != NULL && tas != as) {
+		tlbbatch_init(&tb, tas);
+		tlbbatch_add(&tb, tvaddr);
+		tlbbatch_flush(&tb);
+	}
+
+	same = merge_same(pa, tpa);
+
+	spinlock_acquire(&coremap_lock);
+	pte = merge_lookup(frame, as, vaddr);
+	if (!same || pte == NULL || (*pte & TLBLO_DIRTY)) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	if (tas != NULL) {
+		tpte = merge_lookup(target, tas, tvaddr);
+		if (tpte == NULL || (*tpte & TLBLO_DIRTY)) {
+			spinlock_release(&coremap_lock);
+			return false;
+		}
+		upage_disown(tpa);
+		coremap[target].cm_merged = 1;
+	}
+	else if (!coremap[target].cm_merged) {
+		/* it was copied and freed while we compared */
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	upage_disown(pa);
+	coremap[target].cm_refcount++;
+	*pte = (*pte & ~TLBLO_PPAGE) | (tpa & TLBLO_PPAGE);
+	merge_merged++;
+	spinlock_release(&coremap_lock);
+
+	/* it may have been loaded again, read-only, since the first time */
+	tlbbatch_init(&tb, as);
+	tlbbatch_add(&tb, vaddr);
+	tlbbatch_flush(&tb);
+
+	upage_release(pa);
+	return true;
+}
+
+/*
+ * Look at the next NFRAMES frames.
+ */
+static
+void
+merge_scan(unsigned nframes)
+{
+	struct mergeslot *ms;
+	uint32_t hash;
+	unsigned i;
+	int frame;
+	bool owned;
+
+	for (i = 0; i < nframes; i++) {
+		frame = merge_cursor;
+		merge_cursor = (merge_cursor + 1) % num;
+
+		spinlock_acquire(&coremap_lock);
+		owned = upage_owner(get_paddr(frame)) != NULL;
+		spinlock_release(&coremap_lock);
+		if (!owned) {
+			continue;
+		}
+
+		/* unlocked; a page that changes under us just won't match */
+		hash = merge_hash(get_paddr(frame));
+		merge_scanned++;
+
+		ms = &merge_table[hash % MERGE_TABLESIZE];
+		if (ms->ms_frame == frame) {
+			ms->ms_hash = hash;
+			continue;
+		}
+		if (ms->ms_frame != CM_NOFRAME && ms->ms_hash == hash) {
+			lock_acquire(merge_lock);
+			if (merge_pages(ms->ms_frame, frame)) {
+				lock_release(merge_lock);
+				continue;
+			}
+			lock_release(merge_lock);
+		}
+		ms->ms_hash = hash;
+		ms->ms_frame = frame;
+	}
+}
+
+static
+void
+merge_thread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	for (;;) {
+		clocksleep(1);
+		if (merge_rate > 0) {
+			merge_scan(merge_rate);
+		}
+	}
+}
+
+/*
+ * Start the page merger thread, idle until vm_setmerge gives it a
+ * rate. Called once at boot.
+ */
+void
+vm_mergestart(void)
+{
+	unsigned i;
+	int result;
+
+	for (i = 0; i < MERGE_TABLESIZE; i++) {
+		merge_table[i].ms_frame = CM_NOFRAME;
+	}
+	merge_lock = lock_create("merge");
+	if (merge_lock == NULL) {
+		panic("vm_mergestart: lock_create failed\n");
+	}
+	result = thread_fork("merge", NULL, merge_thread, NULL, 0);
+	if (result) {
+		panic("vm_mergestart: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * Set how many frames the merger looks at each second (0: off).
+ */
+void
+vm_setmerge(unsigned nframes)
+{
+	merge_rate = nframes;
+}
+
+/*
+ * Fault on a page of the mapped file region RG. The page comes from
+ * the page cache, shared with every other mapping of it. Pages of a
+ * writeable mapping are still mapped read-only until the first write,
+ * so that the cache only writes back what was actually changed.
+ */
+static
+int
+vm_file_fault(struct addrspace *as, struct region *rg, unsigned int *pte,
+	      int faulttype, vaddr_t faultaddress)
+{
+	off_t offset;
+	paddr_t pa;
+	bool fromfile;
+	int result;
+
+	offset = rg->rg_offset + (faultaddress - rg->rg_vbase);
+
+	if (faulttype != VM_FAULT_READ && (rg->rg_perms & RG_WRITE) == 0) {
+		return EFAULT;
+	}
+
+	if (faulttype == VM_FAULT_READONLY) {
+		/* first write through an existing mapping */
+		pagecache_dirty(rg->rg_vnode, offset);
+		spinlock_acquire(&coremap_lock);
+		*pte |= TLBLO_DIRTY | PTE_REF;
+		tlb_update(as, faultaddress, PTE_TLBLO(*pte));
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	result = pagecache_get(rg->rg_vnode, offset, &pa, &fromfile);
+	if (result) {
+		return result;
+	}
+	if (fromfile) {
+		vmstats_inc(VMSTAT_MAPPED_FILE_READ);
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		curproc->p_majflt++;
+	}
+	else {
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
+	if (faulttype == VM_FAULT_WRITE) {
+		pagecache_dirty(rg->rg_vnode, offset);
+	}
+
+	spinlock_acquire(&coremap_lock);
+	*pte = PTE_MAKE(pa) | PTE_FILE | PTE_REF;
+	as_rss_add(as, 1);
+	if (faulttype == VM_FAULT_WRITE) {
+		*pte |= TLBLO_DIRTY;
+	}
+	tlb_insert(as, faultaddress, PTE_TLBLO(*pte));
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+/*
+ * Demand loading of programs.
+ *
+ * load_elf only records where each segment's file part is. The first
+ * touch of a page reads in whatever the segments covering it have in
+ * the file; the rest of the page is zero. With demand loading off,
+ * as_complete_load reads in every such page at exec instead, which is
+ * what we used to do.
+ */
+static bool vm_demandload = true;
+
+void
+vm_setdemandload(bool on)
+{
+	vm_demandload = on;
+}
+
+/*
+ * Read the program's file contents for the page at VADDR into the
+ * zeroed frame PA. Two segments can share a page, so look at every
+ * region that covers it. Sets *FROMFILE if anything was read.
+ */
+static
+int
+as_fill_page(struct addrspace *as, vaddr_t vaddr, paddr_t pa, bool *fromfile)
+{
+	struct region *rg;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	*fromfile = false;
+	for (rg = as->as_regions; rg != NULL && rg->rg_vbase <= vaddr;
+	     rg = rg->rg_next) {
+		if (rg->rg_elf == NULL) {
+			continue;
+		}
+		start = rg->rg_elfvaddr > vaddr ? rg->rg_elfvaddr : vaddr;
+		end = rg->rg_elfvaddr + rg->rg_elfsize;
+		if (end > vaddr + PAGE_SIZE) {
+			end = vaddr + PAGE_SIZE;
+		}
+		if (start >= end) {
+			continue;
+		}
+
+		uio_kinit(&iov, &ku,
+			  (void *)(PADDR_TO_KVADDR(pa) + (start - vaddr)),
+			  end - start,
+			  rg->rg_elfoffset + (start - rg->rg_elfvaddr),
+			  UIO_READ);
+		result = VOP_READ(rg->rg_elf, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			/* the file has shrunk since exec */
+			return EIO;
+		}
+		*fromfile = true;
+	}
+	return 0;
+}
+
+/*
+ * If the page at VADDR is program text -- part of the program, and
+ * not writeable by any region even while loading -- return the
+ * program's vnode, so that the page can be shared. Otherwise NULL.
+ */
+static
+struct vnode *
+as_text_vnode(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	struct vnode *v = NULL;
+
+	for (rg = as->as_regions; rg != NULL && rg->rg_vbase <= vaddr;
+	     rg = rg->rg_next) {
+		if (vaddr >= rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			continue;
+		}
+		if (rg->rg_perms & RG_WRITE) {
+			return NULL;
+		}
+		if (rg->rg_elf != NULL) {
+			v = rg->rg_elf;
+		}
+	}
+	return v;
+}
+
+/*
+ * Map the shared text frame PA read-only at VADDR. It has no owner.
+ */
+static
+void
+vm_map_text(struct addrspace *as, unsigned int *pte, vaddr_t vaddr,
+	    paddr_t pa, bool load)
+{
+	spinlock_acquire(&coremap_lock);
+	*pte = PTE_MAKE(pa) | PTE_REF;
+	as_rss_add(as, 1);
+	if (load) {
+		tlb_insert(as, vaddr, PTE_TLBLO(*pte));
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Give the untouched page at VADDR a frame, zero-filled or read from
+ * the program, and map it. Text pages come from (and go into) the
+ * text cache. Unless the page is being written (WRITE), it stays
+ * clean.
+ */
+static
+int
+vm_fill_page(struct addrspace *as, unsigned int *pte, vaddr_t vaddr,
+	     bool load, bool write)
+{
+	struct vnode *text;
+	paddr_t paddr;
+	bool fromfile;
+	int result;
+
+	text = as_text_vnode(as, vaddr);
+	if (text != NULL) {
+		paddr = text_lookup(text, vaddr);
+		if (paddr != 0) {
+			vm_map_text(as, pte, vaddr, paddr, load);
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+			return 0;
+		}
+	}
+
+	paddr = upage_alloc(true);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	result = as_fill_page(as, vaddr, paddr, &fromfile);
+	if (result) {
+		upage_release(paddr);
+		return result;
+	}
+
+	if (text != NULL) {
+		/* may turn out to be someone else's copy */
+		paddr = text_insert(text, vaddr, paddr);
+		vm_map_text(as, pte, vaddr, paddr, load);
+	}
+	else {
+		vm_map_page(as, pte, vaddr, paddr, load, write);
+	}
+	if (fromfile) {
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		curproc->p_majflt++;
 	}
+	else {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	}
+	return 0;
+}
 
-	// flag vmboost done
-	comp = 1;
-#endif
-	/* Do nothing. */
+/*
+ * Fault-around.
+ *
+ * Each address space remembers where it last faulted and the stride
+ * from the fault before. When two faults in a row are the same small
+ * stride apart (a scan through an array, say, or down the stack), the
+ * fault also loads TLB entries for the next vm_faultaround_pages pages
+ * along that stride, as far as the region goes. Only pages that are
+ * already resident are loaded; anything else is left to fault as
+ * usual. The pages loaded get PTE_REF, as if they had faulted: the
+ * scan is about to reach them, so the clock should see them as in
+ * use rather than evict them first.
+ */
+#define FAULTAROUND_MAXSTRIDE   4	/* pages */
+
+static unsigned vm_faultaround_pages = 4;
+
+void
+vm_setfaultaround(unsigned npages)
+{
+	vm_faultaround_pages = npages;
 }
 
 static
-paddr_t
-getppages(unsigned long npages)
+void
+vm_faultaround(struct addrspace *as, vaddr_t vaddr)
 {
-	paddr_t addr;
-
-#if OPT_A3
-	if(comp){
-		addr = alloc_kpages(npages) - MIPS_KSEG0;
-	} else {
-		spinlock_acquire(&stealmem_lock);
+	struct region *rg;
+	unsigned int *pte;
+	vaddr_t va, end;
+	unsigned k, loaded;
+	int stride;
+	bool steady;
+
+	stride = ((int)vaddr - (int)as->as_lastfault) / PAGE_SIZE;
+	steady = stride == as->as_stride;
+	as->as_lastfault = vaddr;
+	as->as_stride = stride;
+
+	if (!steady || stride == 0 || stride > FAULTAROUND_MAXSTRIDE ||
+	    stride < -FAULTAROUND_MAXSTRIDE || vm_faultaround_pages == 0) {
+		return;
+	}
+	rg = as_find_region(as, vaddr);
+	if (rg == NULL) {
+		return;
+	}
+	end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
 
-		addr = ram_stealmem(npages);
-	
-		spinlock_release(&stealmem_lock);
+	loaded = 0;
+	spinlock_acquire(&coremap_lock);
+	for (k = 1; k <= vm_faultaround_pages; k++) {
+		/*
+		 * For a negative stride the unsigned sum is still the
+		 * right address below VADDR; the loop stops at rg_vbase.
+		 */
+		va = vaddr + (vaddr_t)(k * stride) * PAGE_SIZE;
+		if (va < rg->rg_vbase || va >= end) {
+			break;
+		}
+		pte = as_lookup_pte(as, va, false);
+		if (pte == NULL || !PTE_RESIDENT(*pte)) {
+			continue;
+		}
+		if (tlb_prefill(as, va, PTE_TLBLO(*pte))) {
+			*pte |= PTE_REF;
+			loaded++;
+		}
 	}
-#else
-	spinlock_acquire(&stealmem_lock);
+	spinlock_release(&coremap_lock);
 
-	addr = ram_stealmem(npages);
-	
-	spinlock_release(&stealmem_lock);
-#endif
-	return addr;
+	vmstats_inc(VMSTAT_FAULTAROUND);
+	while (loaded-- > 0) {
+		vmstats_inc(VMSTAT_TLB_PREFILL);
+	}
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+/*
+ * Service a fault at FAULTADDRESS, in region RG (NULL for a page the
+ * stack has just grown over), whose page table entry is PTE.
+ */
+static
+int
+vm_fault_page(struct addrspace *as, struct region *rg, unsigned int *pte,
+	      int faulttype, vaddr_t faultaddress)
 {
-	paddr_t pa;
-#if OPT_A3
-	if(comp){
-		int is_found = 1;
-		if(npages == 0) return 0;
-
-		spinlock_acquire(&coremap_lock);
-
-		KASSERT(coremap != NULL);
+	if (rg != NULL && rg->rg_vnode != NULL &&
+	    (*pte == 0 || faulttype == VM_FAULT_READONLY)) {
+		return vm_file_fault(as, rg, pte, faulttype, faultaddress);
+	}
 
-		for(int i = 0; i < num; i++){
-			for(int j = i; j < i + npages; j++){
-				if(coremap[j] != 0){
-					is_found = 0;
-					break;
-				}
+	spinlock_acquire(&coremap_lock);
+	if (PTE_RESIDENT(*pte)) {
+		if (faulttype == VM_FAULT_READONLY) {
+			if (!as_writeable(as, faultaddress)) {
+				/* A real write to a read-only page (text). */
+				spinlock_release(&coremap_lock);
+				return EFAULT;
 			}
-			if(is_found){
-				coremap[i] = npages;
-				for(int j = i + 1; j < i + npages; j++){
-					coremap[j] = 1;
-				}
-				pa = startcont + i * PAGE_SIZE;
+			if (upage_owner(PTE_PADDR(*pte)) == as) {
+				/* first write to a clean page */
+				upage_setdirty(PTE_PADDR(*pte), true);
+				*pte |= TLBLO_DIRTY | PTE_REF;
+				tlb_update(as, faultaddress, PTE_TLBLO(*pte));
 				spinlock_release(&coremap_lock);
-			
-				return PADDR_TO_KVADDR(pa);
+				return 0;
 			}
-			is_found = 1;
+			/* shared: copy-on-write, or clean when forked */
+			spinlock_release(&coremap_lock);
+			return vm_cow_fault(as, pte, faultaddress);
 		}
 
+		/* make sure it's page-aligned */
+		KASSERT((PTE_PADDR(*pte) & PAGE_FRAME) == PTE_PADDR(*pte));
+
+		*pte |= PTE_REF;
+		tlb_insert(as, faultaddress, PTE_TLBLO(*pte));
 		spinlock_release(&coremap_lock);
+		vmstats_inc(VMSTAT_TLB_RELOAD);
 		return 0;
 	}
-#endif
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
-	}
-	return PADDR_TO_KVADDR(pa);
-}
-
-void 
-free_kpages(vaddr_t addr)
-{
-	/* nothing - leak the memory. */
-#if OPT_A3
-	paddr_t pad = addr - MIPS_KSEG0; // later
-
-	spinlock_acquire(&coremap_lock);
-
-	// start from where to free
-	int nthframe = (pad - startcont) / PAGE_SIZE;
-
-	// length need to free
-	KASSERT(coremap != NULL);
-
-	int x = coremap [(pad - startcont) / PAGE_SIZE];
+	spinlock_release(&coremap_lock);
 
-	// free
-	for(int i = nthframe; i < nthframe + x; i++){
-		coremap[i] = 0;
+	/*
+	 * Not resident. (A READONLY fault lands here if the page was
+	 * paged out after the TLB entry was used; the retried access
+	 * sorts out whether the write is allowed.)
+	 */
+	if (PTE_ONSWAP(*pte)) {
+		return vm_swapin(as, pte, faultaddress);
 	}
 
-	spinlock_release(&coremap_lock);
-#else
-	(void)addr;
-#endif
+	/* First touch: zero-fill it, or read it from the program. */
+	return vm_fill_page(as, pte, faultaddress, true,
+			    faulttype == VM_FAULT_WRITE);
 }
 
-void
-vm_tlbshootdown_all(void)
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+	struct addrspace *as;
+	struct region *rg;
+	unsigned int *pte;
+	unsigned majflt;
+	int result;
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+	faultaddress &= PAGE_FRAME;
 
-#if OPT_A3
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
-// helper functions for page///////////////////////////////////////////////
-unsigned int
-get_page_num(vaddr_t vad, vaddr_t vbase){
-	return (vad - vbase) / PAGE_SIZE;
-}
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
 
-paddr_t
-get_page_offset(vaddr_t vad, vaddr_t vbase){
-	return (paddr_t)(vad - vbase) % PAGE_SIZE;
-}
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
 
-unsigned int
-get_frame_num(paddr_t pad){
-	return (unsigned int)(pad - startcont)/PAGE_SIZE;;
-}
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
 
-paddr_t
-get_paddr(unsigned int i){
-	return i * PAGE_SIZE + startcont;
+	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_pgdir != NULL);
+
+	rg = as_find_region(as, faultaddress);
+	if (rg == NULL) {
+		/* maybe the stack needs to grow */
+		result = as_grow_stack(as, faultaddress, curthread->t_usersp);
+		if (result) {
+			return result;
+		}
+	}
+	pte = as_lookup_pte(as, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	/* the page-in paths count major faults themselves */
+	majflt = curproc->p_majflt;
+	result = vm_fault_page(as, rg, pte, faulttype, faultaddress);
+	if (result == 0) {
+		if (curproc->p_majflt == majflt) {
+			curproc->p_minflt++;
+		}
+		if (faulttype != VM_FAULT_READONLY) {
+			curproc->p_tlbmiss++;
+			vm_faultaround(as, faultaddress);
+		}
+	}
+	return result;
 }
 
-#endif
+#else
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
@@ -245,13 +3068,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
 	switch (faulttype) {
-	    case VM_FAULT_READONLY:;
+	    case VM_FAULT_READONLY:
 		/* We always create pages read-write, so we can't get this */
-		#if OPT_A3
-		return EFAULT;
-		#else
 		panic("dumbvm: got VM_FAULT_READONLY\n");
-		#endif
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -284,23 +3103,12 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	KASSERT(as->as_vbase2 != 0);
 	KASSERT(as->as_pbase2 != 0);
 	KASSERT(as->as_npages2 != 0);
-#if OPT_A3
-#else
 	KASSERT(as->as_stackpbase != 0);
-#endif
-#if OPT_A3
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	//KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	//KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	//KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-#else
 	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
 	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
 	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
 	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
 	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-#endif
 
 	vbase1 = as->as_vbase1;
 	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
@@ -310,113 +3118,316 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	stacktop = USERSTACK;
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-	#if OPT_A3
-		KASSERT(as->as_pbase1 != NULL);
-
-		paddr = get_paddr(as->as_pbase1[get_page_num(faultaddress, as->as_vbase1)]) + 
-				get_page_offset(faultaddress, as->as_vbase1);
-	#else
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
-	#endif
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-	#if OPT_A3
-		KASSERT(as->as_pbase2 != NULL);
-
-		paddr = get_paddr(as->as_pbase2[get_page_num(faultaddress, as->as_vbase2)]) + 
-				get_page_offset(faultaddress, as->as_vbase2);
-	#else
 		paddr = (faultaddress - vbase2) + as->as_pbase2;
-	#endif
 	}
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-	#if OPT_A3
-		KASSERT(as->as_stackpbase != NULL);
-
-		paddr = get_paddr(as->as_stackpbase[get_page_num(faultaddress, stackbase)]) + 
-				get_page_offset(faultaddress, stackbase);
-	#else
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
-	#endif
 	}
 	else {
 		return EFAULT;
 	}
 
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
-
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+	/* make sure it's page-aligned */
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if (elo & TLBLO_VALID) {
+			continue;
+		}
+		ehi = faultaddress;
+		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return 0;
+	}
+
+	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+	splx(spl);
+	return EFAULT;
+}
+
+#endif
+
+#if OPT_A3
+
+// helper functions for page tables////////////////////////////////
+
+/*
+ * Take one page out of an address space: clear its PTE and free its
+ * swap slot, if any. A resident page's frame is handed back instead
+ * of being released, so that the caller can shoot down the old
+ * translations before the frame is reused; 0 means there is no frame.
+ */
+static
+paddr_t
+as_detach_page(struct addrspace *as, unsigned int *pte)
+{
+	unsigned int old;
+
+	/* mapped file pages go back through as_unmap_region */
+	KASSERT((*pte & PTE_FILE) == 0);
+
+	while(*pte != 0){
+		spinlock_acquire(&coremap_lock);
+		old = *pte;
+		if(PTE_RESIDENT(old)){
+			/* take it away from the clock first */
+			upage_disown(PTE_PADDR(old));
+			*pte = 0;
+			as_rss_add(as, -1);
+		}
+		spinlock_release(&coremap_lock);
+
+		if(PTE_RESIDENT(old)){
+			return PTE_PADDR(old);
+		}
+		if(!PTE_ONSWAP(old)){
+			*pte = 0;
+			return 0;
+		}
+
+		/*
+		 * Swapped, or still being written out; swap_lock
+		 * waits for the latter. A page-out that failed puts
+		 * the page back, so go round again if it's resident.
+		 */
+		lock_acquire(swap_lock);
+		if(PTE_ONSWAP(*pte)){
+			swap_free(PTE_SWAPSLOT(*pte));
+			*pte = 0;
+		}
+		lock_release(swap_lock);
+	}
+	return 0;
+}
+
+/*
+ * Let go of one page of an address space that is going away, and
+ * can't be in any TLB.
+ */
+static
+void
+as_free_page(struct addrspace *as, unsigned int *pte)
+{
+	paddr_t pa;
+
+	pa = as_detach_page(as, pte);
+	if(pa != 0){
+		upage_release(pa);
+	}
+}
+
+/*
+ * Give the new address space a copy of one page of the old one,
+ * which belongs to the current process. Resident pages are shared:
+ * writeable ones become copy-on-write in both, read-only ones are
+ * simply shared. The caller must flush the old mappings out of the
+ * TLB afterwards.
+ */
+static
+int
+as_copy_page(struct addrspace *new, vaddr_t vaddr,
+	     unsigned int *newpte, unsigned int *oldpte)
+{
+	paddr_t pa;
+	int result;
+
+	for(;;){
+		spinlock_acquire(&coremap_lock);
+		if(PTE_RESIDENT(*oldpte)){
+			if(*oldpte & TLBLO_DIRTY){
+				*oldpte = (*oldpte & ~TLBLO_DIRTY) | PTE_COW;
+			}
+			upage_share(PTE_PADDR(*oldpte));
+			*newpte = *oldpte;
+			as_rss_add(new, 1);
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+		spinlock_release(&coremap_lock);
+
+		if(!PTE_ONSWAP(*oldpte)){
+			/* never touched */
+			return 0;
+		}
+
+		/*
+		 * Paged out: read the new space its own copy straight
+		 * from swap instead of paging the old one back in.
+		 */
+		lock_acquire(swap_lock);
+		if(PTE_ONSWAP(*oldpte)){
+			pa = upage_alloc(false);
+			if(pa == 0){
+				lock_release(swap_lock);
+				return ENOMEM;
+			}
+			result = swap_pagein(PTE_SWAPSLOT(*oldpte), pa, NULL);
+			if(result){
+				upage_release(pa);
+				lock_release(swap_lock);
+				return result;
+			}
+			vm_map_page(new, newpte, vaddr, pa, false, true);
+			lock_release(swap_lock);
+			return 0;
+		}
+		/* a failed page-out put it back; share it after all */
+		lock_release(swap_lock);
+	}
+}
+
+/*
+ * Drop write permission from the pages of AS that no writeable
+ * region covers (used to make the text read-only once it has been
+ * loaded).
+ */
+static
+void
+as_protect_pages(struct addrspace *as)
+{
+	struct region *rg;
+	unsigned int *pte;
+	vaddr_t va;
+	size_t i;
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
+	for(rg = as->as_regions; rg != NULL; rg = rg->rg_next){
+		if(rg->rg_perms & RG_WRITE){
 			continue;
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-#if OPT_A3
-		if (faultaddress >= vbase1 && faultaddress < vtop1 && as->flag) {
-			elo = paddr | TLBLO_VALID;
+		for(i = 0; i < rg->rg_npages; i++){
+			va = rg->rg_vbase + i * PAGE_SIZE;
+			if(as_writeable(as, va)){
+				continue;
+			}
+			pte = as_lookup_pte(as, va, false);
+			if(pte == NULL){
+				continue;
+			}
+			spinlock_acquire(&coremap_lock);
+			*pte &= ~(TLBLO_DIRTY | PTE_COW);
+			spinlock_release(&coremap_lock);
 		}
-#endif
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}
-#if OPT_A3
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	if (faultaddress >= vbase1 && faultaddress < vtop1 && as->flag) {
-		elo = paddr | TLBLO_VALID;
 	}
-	tlb_random(ehi, elo);
-	splx(spl);
-	return 0;
-#else
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
-#endif
 }
 
-#if OPT_A3
-
-// helper functions for as segpages////////////////////////////////
+/*
+ * Hand the pages of the mapped file region RG back to the page cache,
+ * which writes them back and frees them if this was the last mapping.
+ * The pages are unmapped and shot down TLBSHOOTDOWN_MAX at a time,
+ * and only then released, so nothing can still write to a page once
+ * it has been written back.
+ */
+static
 void
-as_set_segpages(size_t s, unsigned int * pb){
-	KASSERT(pb != NULL);
-
-	for(size_t i = 0; i < s; i++){
-		paddr_t pad = getppages(1);
-		unsigned int f = get_frame_num(pad);
-		pb[i] = f;
+as_unmap_region(struct addrspace *as, struct region *rg)
+{
+	off_t offsets[TLBSHOOTDOWN_MAX];
+	struct tlbbatch tb;
+	unsigned int *pte;
+	vaddr_t va;
+	size_t i;
+	unsigned j, n;
+
+	KASSERT(rg->rg_vnode != NULL);
+
+	i = 0;
+	while(i < rg->rg_npages){
+		tlbbatch_init(&tb, as);
+		n = 0;
+		for(; i < rg->rg_npages && n < TLBSHOOTDOWN_MAX; i++){
+			va = rg->rg_vbase + i * PAGE_SIZE;
+			pte = as_lookup_pte(as, va, false);
+			if(pte == NULL || *pte == 0){
+				continue;
+			}
+			KASSERT(*pte & PTE_FILE);
+			spinlock_acquire(&coremap_lock);
+			*pte = 0;
+			as_rss_add(as, -1);
+			spinlock_release(&coremap_lock);
+			tlbbatch_add(&tb, va);
+			offsets[n++] = rg->rg_offset + i * PAGE_SIZE;
+		}
+		tlbbatch_flush(&tb);
+		for(j = 0; j < n; j++){
+			pagecache_release(rg->rg_vnode, offsets[j]);
+		}
 	}
 }
 
-void
-as_free_segpages(size_t s, unsigned int * pb){
-	KASSERT(pb != NULL);
+/*
+ * Find room for NPAGES of mappings as high as possible below TOP, with
+ * an unmapped page on either side. Returns 0 if there is none.
+ */
+static
+vaddr_t
+as_find_gap(struct addrspace *as, vaddr_t top, size_t npages)
+{
+	struct region *rg;
+	vaddr_t base, end;
 
-	for(size_t i = 0; i < s; i++){
-		free_kpages(PADDR_TO_KVADDR(get_paddr(pb[i])));
+	end = top;
+ again:
+	if(end < (npages + 1) * PAGE_SIZE){
+		return 0;
+	}
+	base = end - npages * PAGE_SIZE;
+	for(rg = as->as_regions; rg != NULL; rg = rg->rg_next){
+		if(rg->rg_vbase < end + PAGE_SIZE &&
+		   rg->rg_vbase + (rg->rg_npages + 1) * PAGE_SIZE > base){
+			if(rg->rg_vbase < PAGE_SIZE){
+				return 0;
+			}
+			end = rg->rg_vbase - PAGE_SIZE;
+			goto again;
+		}
 	}
+	return base;
 }
 
-void
-as_copy_segpages(size_t sold, unsigned int * pbnew, unsigned int * pbold){
-	KASSERT(pbnew != NULL);
-	KASSERT(pbold != NULL);
-
-	for(size_t i = 0; i < sold; i++){
-		memmove((void *)PADDR_TO_KVADDR(
-			get_paddr(pbnew[i])),
-		(const void *)PADDR_TO_KVADDR(
-			get_paddr(pbold[i])),
-		PAGE_SIZE);
+/*
+ * Read in every page of the program now (demand loading off).
+ */
+static
+int
+as_load_segments(struct addrspace *as)
+{
+	struct region *rg;
+	unsigned int *pte;
+	vaddr_t va;
+	size_t i;
+	int result;
+
+	for(rg = as->as_regions; rg != NULL; rg = rg->rg_next){
+		if(rg->rg_elf == NULL){
+			continue;
+		}
+		for(i = 0; i < rg->rg_npages; i++){
+			va = rg->rg_vbase + i * PAGE_SIZE;
+			pte = as_lookup_pte(as, va, true);
+			if(pte == NULL){
+				return ENOMEM;
+			}
+			if(*pte != 0){
+				/* shared with the segment before */
+				continue;
+			}
+			result = vm_fill_page(as, pte, va, false, false);
+			if(result){
+				return result;
+			}
+		}
 	}
+	return 0;
 }
 
 #endif
@@ -430,14 +3441,26 @@ as_create(void)
 	}
 #if OPT_A3
 	as->flag = 0;
+	as->as_regions = NULL;
+	as->as_stack = NULL;
+	as->as_stackmax = STACK_MAXPAGES;
+	as->as_heap = NULL;
+	as->as_heapbrk = 0;
+	as->as_lastfault = 0;
+	as->as_stride = 0;
+	as->as_rss = 0;
+	as->as_maxrss = 0;
+
+	as->as_pgdir = kmalloc(PT_L1SIZE * sizeof(unsigned int *));
+	if(as->as_pgdir == NULL){
+		kfree(as);
+		return NULL;
+	}
+	bzero(as->as_pgdir, PT_L1SIZE * sizeof(unsigned int *));
 
-	as->as_vbase1 = 0;
-	as->as_pbase1 = NULL;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = NULL;
-	as->as_npages2 = 0;
-	as->as_stackpbase = NULL;
+	for(int i = 0; i < MAXCPUS; i++){
+		as->as_asid[i] = 0;
+	}
 #else
 	as->as_vbase1 = 0;
 	as->as_pbase1 = 0;
@@ -455,18 +3478,55 @@ void
 as_destroy(struct addrspace *as)
 {
 #if OPT_A3
-	// p1
-	as_free_segpages(as->as_npages1, as->as_pbase1);
+	struct region *rg;
+	unsigned int *pt;
+
+	/* no refill handler may walk these tables any more */
+	for(unsigned i = 0; i < MAXCPUS; i++){
+		if(vm_fastpgdir[i] == as->as_pgdir){
+			vm_fastpgdir[i] = NULL;
+		}
+	}
+
+	for(rg = as->as_regions; rg != NULL; rg = rg->rg_next){
+		if(rg->rg_vnode != NULL){
+			as_unmap_region(as, rg);
+		}
+	}
 
-	// p2
-	as_free_segpages(as->as_npages2, as->as_pbase2);
+	for(unsigned i = 0; i < PT_L1SIZE; i++){
+		pt = as->as_pgdir[i];
+		if(pt == NULL){
+			continue;
+		}
+		for(unsigned j = 0; j < PT_L2SIZE; j++){
+			as_free_page(as, &pt[j]);
+		}
+		as->as_pgdir[i] = NULL;
+		free_kpages((vaddr_t)pt);
+	}
+	kfree(as->as_pgdir);
 
-	// stack
-	as_free_segpages(DUMBVM_STACKPAGES, as->as_stackpbase);
+	while((rg = as->as_regions) != NULL){
+		as->as_regions = rg->rg_next;
+		if(rg->rg_vnode != NULL){
+			VOP_DECREF(rg->rg_vnode);
+		}
+		if(rg->rg_elf != NULL){
+			VOP_DECREF(rg->rg_elf);
+		}
+		kfree(rg);
+	}
 
-	kfree(as->as_pbase1);
-	kfree(as->as_pbase2);
-	kfree(as->as_stackpbase);
+	/* a page-out or a merge may still be looking at our pages */
+	if(swap_enabled()){
+		lock_acquire(swap_lock);
+		lock_release(swap_lock);
+	}
+	if(merge_lock != NULL){
+		lock_acquire(merge_lock);
+		lock_release(merge_lock);
+	}
 #endif
 	kfree(as);
 }
@@ -474,7 +3534,11 @@ as_destroy(struct addrspace *as)
 void
 as_activate(void)
 {
+#if OPT_A3
+	int spl;
+#else
 	int i, spl;
+#endif
 	struct addrspace *as;
 
 	as = curproc_getas();
@@ -488,9 +3552,14 @@ as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+#if OPT_A3
+	/* our translations stay in the TLB under our ASID */
+	asid_activate(as);
+#else
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+#endif
 
 	splx(spl);
 }
@@ -498,7 +3567,15 @@ as_activate(void)
 void
 as_deactivate(void)
 {
+#if OPT_A3
+	int spl;
+
+	spl = splhigh();
+	vm_fastpgdir[curcpu->c_number] = NULL;
+	splx(spl);
+#else
 	/* nothing */
+#endif
 }
 
 int
@@ -516,6 +3593,17 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
+#if OPT_A3
+	if (vaddr >= USERSPACETOP || sz > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+
+	/* Nothing is allocated until the pages are touched. */
+	return as_add_region(as, vaddr, npages,
+			     (readable ? RG_READ : 0) |
+			     (writeable ? RG_WRITE : 0) |
+			     (executable ? RG_EXEC : 0), NULL);
+#else
 	/* We won't use these - all pages are read-write */
 	(void)readable;
 	(void)writeable;
@@ -524,28 +3612,12 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	if (as->as_vbase1 == 0) {
 		as->as_vbase1 = vaddr;
 		as->as_npages1 = npages;
-#if OPT_A3
-		as->as_pbase1 = kmalloc(sizeof(int) * npages);
-		if(!as->as_pbase1){
-			return ENOMEM;
-		}
-
-		KASSERT(as->as_pbase1 != NULL);
-#endif
 		return 0;
 	}
 
 	if (as->as_vbase2 == 0) {
 		as->as_vbase2 = vaddr;
 		as->as_npages2 = npages;
-#if OPT_A3
-		as->as_pbase2 = kmalloc(sizeof(int) * npages);
-		if(!as->as_pbase2){
-			return ENOMEM;
-		}
-
-		KASSERT(as->as_pbase2 != NULL);
-#endif
 		return 0;
 	}
 
@@ -554,6 +3626,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	 */
 	kprintf("dumbvm: Warning: too many regions\n");
 	return EUNIMP;
+#endif
 }
 #if OPT_A3
 #else
@@ -568,15 +3641,13 @@ int
 as_prepare_load(struct addrspace *as)
 {
 #if OPT_A3
+	/* Pages are allocated and zeroed as load_elf touches them. */
+	KASSERT(as->as_pgdir != NULL);
 #else
 	KASSERT(as->as_pbase1 == 0);
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
-#endif
-#if OPT_A3
-	as_set_segpages(as->as_npages1, as->as_pbase1);
-	as_set_segpages(as->as_npages2, as->as_pbase2);
-#else
+
 	as->as_pbase1 = getppages(as->as_npages1);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
@@ -604,8 +3675,32 @@ int
 as_complete_load(struct addrspace *as)
 {
 #if OPT_A3
+	struct region *rg;
+	vaddr_t top = 0;
+	int result;
+
+	/* the heap starts, empty, on the page after the program */
+	for(rg = as->as_regions; rg != NULL; rg = rg->rg_next){
+		if(rg->rg_vbase + rg->rg_npages * PAGE_SIZE > top){
+			top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		}
+	}
+	result = as_add_region(as, top, 0, RG_READ | RG_WRITE, &as->as_heap);
+	if(result){
+		return result;
+	}
+	as->as_heapbrk = top;
+
+	if(!vm_demandload){
+		result = as_load_segments(as);
+		if(result){
+			return result;
+		}
+	}
+
 	as->flag = 1;
-	as_activate();
+	as_protect_pages(as);
+	as_flush_tlb(as);
 #else
 	(void)as;
 #endif
@@ -616,15 +3711,18 @@ int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {	
 #if OPT_A3
-	as->as_stackpbase = kmalloc(sizeof(int) * DUMBVM_STACKPAGES);
-	if(!as->as_stackpbase){
-		return ENOMEM;
-	}
-
-	KASSERT(as->as_stackpbase != 0);
-
-	as_set_segpages(DUMBVM_STACKPAGES, as->as_stackpbase);
+	int result;
 
+	/*
+	 * The stack pages themselves are demand-zero as well, and the
+	 * region grows down as they are touched (see as_grow_stack).
+	 */
+	result = as_add_region(as, USERSTACK - STACK_INITPAGES * PAGE_SIZE,
+			       STACK_INITPAGES, RG_READ | RG_WRITE,
+			       &as->as_stack);
+	if(result){
+		return result;
+	}
 #else
 	KASSERT(as->as_stackpbase != 0);
 
@@ -633,71 +3731,282 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Move the break of AS, which must be the current address space, by
+ * AMOUNT bytes. Growing only moves the end of the heap region; the
+ * pages are demand-zero. Shrinking gives back every page wholly above
+ * the new break, so the heap comes back zeroed if it grows again.
+ * They are unmapped and shot down TLBSHOOTDOWN_MAX at a time, and
+ * their frames only freed after that. The heap can't grow to within
+ * a page of the next region up (the stack's guard page, normally).
+ */
 int
-as_copy(struct addrspace *old, struct addrspace **ret)
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
 {
-	struct addrspace *new;
+	struct region *heap = as->as_heap;
+	vaddr_t newbrk, newtop, oldtop, va;
+	paddr_t frames[TLBSHOOTDOWN_MAX];
+	unsigned int *pte;
+	struct tlbbatch tb;
+	unsigned i, n;
+	paddr_t pa;
 
-	new = as_create();
-	if (new==NULL) {
+	if(heap == NULL){
 		return ENOMEM;
 	}
 
-	new->as_vbase1 = old->as_vbase1;
-	new->as_npages1 = old->as_npages1;
-#if OPT_A3
-	new->as_pbase1 = kmalloc(sizeof(int) * new->as_npages1);
-	if(!new->as_pbase1){
+	*oldbreak = as->as_heapbrk;
+	if(amount < 0){
+		if((vaddr_t)-amount > as->as_heapbrk - heap->rg_vbase){
+			return EINVAL;
+		}
+	}
+	else if((vaddr_t)amount >= USERSPACETOP - as->as_heapbrk){
 		return ENOMEM;
 	}
+	newbrk = as->as_heapbrk + amount;
 
-	KASSERT(new->as_pbase1 != NULL);
-#endif
-	new->as_vbase2 = old->as_vbase2;
-	new->as_npages2 = old->as_npages2;
-#if OPT_A3
-	new->as_pbase2 = kmalloc(sizeof(int) * new->as_npages2);
-	if(!new->as_pbase2){
+	newtop = ROUNDUP(newbrk, PAGE_SIZE);
+	oldtop = heap->rg_vbase + heap->rg_npages * PAGE_SIZE;
+	if(newtop > oldtop && heap->rg_next != NULL &&
+	   newtop + PAGE_SIZE > heap->rg_next->rg_vbase){
 		return ENOMEM;
 	}
 
-	KASSERT(new->as_pbase2 != NULL);
-#endif
+	heap->rg_npages = (newtop - heap->rg_vbase) / PAGE_SIZE;
+	as->as_heapbrk = newbrk;
+
+	va = newtop;
+	while(va < oldtop){
+		tlbbatch_init(&tb, as);
+		n = 0;
+		for(; va < oldtop && n < TLBSHOOTDOWN_MAX; va += PAGE_SIZE){
+			pte = as_lookup_pte(as, va, false);
+			if(pte == NULL || *pte == 0){
+				continue;
+			}
+			pa = as_detach_page(as, pte);
+			if(pa != 0){
+				tlbbatch_add(&tb, va);
+				frames[n++] = pa;
+			}
+		}
+		tlbbatch_flush(&tb);
+		for(i = 0; i < n; i++){
+			upage_release(frames[i]);
+		}
+	}
+	return 0;
+}
 
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
+/*
+ * Map part of a file into AS, which must be the current address
+ * space. Mappings go as high as they fit below the furthest the stack
+ * may grow, each with a guard page either side; the address asked for
+ * is only a hint, and we don't take it. All mappings are shared.
+ */
+int
+as_mmap(struct addrspace *as, struct vnode *vn, off_t offset,
+	size_t len, int perms, vaddr_t *ret)
+{
+	struct region *rg;
+	size_t npages;
+	vaddr_t vbase;
+	int result;
+
+	if(len == 0 || offset < 0 || offset % PAGE_SIZE != 0){
+		return EINVAL;
+	}
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+
+	result = VOP_MMAP(vn);
+	if(result){
+		return result;
+	}
+
+	vbase = as_find_gap(as, USERSTACK - (as->as_stackmax + 1) * PAGE_SIZE,
+			    npages);
+	if(vbase == 0){
 		return ENOMEM;
 	}
+	result = as_add_region(as, vbase, npages, perms, &rg);
+	if(result){
+		return result;
+	}
+	VOP_INCREF(vn);
+	rg->rg_vnode = vn;
+	rg->rg_offset = offset;
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
+	*ret = vbase;
+	return 0;
+}
 
-#if OPT_A3
-#else
-	KASSERT(new->as_stackpbase != 0);
+/*
+ * Remove the mapping that starts at VADDR, writing back its dirty
+ * pages if nothing else maps them.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg, **prev;
+
+	for(prev = &as->as_regions; (rg = *prev) != NULL;
+	    prev = &rg->rg_next){
+		if(rg->rg_vbase == vaddr){
+			break;
+		}
+	}
+	if(rg == NULL || rg->rg_vnode == NULL ||
+	   DIVROUNDUP(len, PAGE_SIZE) != rg->rg_npages){
+		return EINVAL;
+	}
+
+	*prev = rg->rg_next;
+	as_unmap_region(as, rg);
+	VOP_DECREF(rg->rg_vnode);
+	kfree(rg);
+	return 0;
+}
+
+/*
+ * Record where the file part of the program segment at VADDR is, for
+ * as_fill_page. It belongs to the region as_define_region made for
+ * the segment: the one starting on VADDR's page that can hold it.
+ */
+int
+as_define_segment(struct addrspace *as, struct vnode *v, off_t offset,
+		  vaddr_t vaddr, size_t filesize)
+{
+	struct region *rg;
+
+	for(rg = as->as_regions; rg != NULL; rg = rg->rg_next){
+		if(rg->rg_vbase == (vaddr & PAGE_FRAME) && rg->rg_elf == NULL &&
+		   rg->rg_vnode == NULL &&
+		   vaddr + filesize <= rg->rg_vbase + rg->rg_npages * PAGE_SIZE){
+			break;
+		}
+	}
+	if(rg == NULL){
+		return ENOEXEC;
+	}
+
+	VOP_INCREF(v);
+	rg->rg_elf = v;
+	rg->rg_elfvaddr = vaddr;
+	rg->rg_elfoffset = offset;
+	rg->rg_elfsize = filesize;
+	return 0;
+}
 #endif
 
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
 #if OPT_A3
-	new->as_stackpbase = kmalloc(sizeof(int) * DUMBVM_STACKPAGES);
-	if(!new->as_stackpbase){
+	struct region *rg, *newrg;
+	unsigned int *pte;
+	paddr_t pa;
+	vaddr_t va;
+	int result;
+#endif
+
+	new = as_create();
+	if (new==NULL) {
 		return ENOMEM;
 	}
 
-	KASSERT(new->as_stackpbase != NULL);
-	
-	as_set_segpages(DUMBVM_STACKPAGES, new->as_stackpbase);
+#if OPT_A3
+	new->flag = old->flag;
+	new->as_stackmax = old->as_stackmax;
+	new->as_heapbrk = old->as_heapbrk;
+
+	for(rg = old->as_regions; rg != NULL; rg = rg->rg_next){
+		result = as_add_region(new, rg->rg_vbase, rg->rg_npages,
+				       rg->rg_perms, &newrg);
+		if(result){
+			goto fail;
+		}
+		if(rg == old->as_stack){
+			new->as_stack = newrg;
+		}
+		else if(rg == old->as_heap){
+			new->as_heap = newrg;
+		}
+		if(rg->rg_vnode != NULL){
+			VOP_INCREF(rg->rg_vnode);
+			newrg->rg_vnode = rg->rg_vnode;
+			newrg->rg_offset = rg->rg_offset;
+		}
+		if(rg->rg_elf != NULL){
+			VOP_INCREF(rg->rg_elf);
+			newrg->rg_elf = rg->rg_elf;
+			newrg->rg_elfvaddr = rg->rg_elfvaddr;
+			newrg->rg_elfoffset = rg->rg_elfoffset;
+			newrg->rg_elfsize = rg->rg_elfsize;
+		}
+	}
 
-	// p1
-	as_copy_segpages(old->as_npages1, new->as_pbase1, old->as_pbase1);
+	/*
+	 * Share the parent's frames copy-on-write, table by table.
+	 * Mapped file pages are shared outright.
+	 */
+	for(unsigned i = 0; i < PT_L1SIZE; i++){
+		if(old->as_pgdir[i] == NULL){
+			continue;
+		}
+		for(unsigned j = 0; j < PT_L2SIZE; j++){
+			if(old->as_pgdir[i][j] == 0){
+				continue;
+			}
+			va = PT_VADDR(i, j);
+			pte = as_lookup_pte(new, va, true);
+			if(pte == NULL){
+				result = ENOMEM;
+				goto fail;
+			}
+			if(old->as_pgdir[i][j] & PTE_FILE){
+				rg = as_find_region(old, va);
+				KASSERT(rg != NULL && rg->rg_vnode != NULL);
+				result = pagecache_get(rg->rg_vnode,
+					rg->rg_offset + (va - rg->rg_vbase),
+					&pa, NULL);
+				if(result == 0){
+					KASSERT(pa == PTE_PADDR(old->as_pgdir[i][j]));
+					spinlock_acquire(&coremap_lock);
+					*pte = old->as_pgdir[i][j];
+					as_rss_add(new, 1);
+					spinlock_release(&coremap_lock);
+				}
+			}
+			else{
+				result = as_copy_page(new, va, pte,
+						      &old->as_pgdir[i][j]);
+			}
+			if(result){
+				goto fail;
+			}
+		}
+	}
 
-	// p2
-	as_copy_segpages(old->as_npages2, new->as_pbase2, old->as_pbase2);
+	/* the parent may still have writeable TLB entries for them */
+	as_flush_tlb(old);
+#else
+	new->as_vbase1 = old->as_vbase1;
+	new->as_npages1 = old->as_npages1;
+	new->as_vbase2 = old->as_vbase2;
+	new->as_npages2 = old->as_npages2;
 
-	//stack
-	as_copy_segpages(DUMBVM_STACKPAGES, new->as_stackpbase, old->as_stackpbase);
+	/* (Mis)use as_prepare_load to allocate some physical memory. */
+	if (as_prepare_load(new)) {
+		as_destroy(new);
+		return ENOMEM;
+	}
 
-#else
+	KASSERT(new->as_pbase1 != 0);
+	KASSERT(new->as_pbase2 != 0);
+	KASSERT(new->as_stackpbase != 0);
 
 	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
 		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
@@ -713,4 +4022,12 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 #endif
 	*ret = new;
 	return 0;
+#if OPT_A3
+
+ fail:
+	as_destroy(new);
+	/* the parent's pages may already be copy-on-write */
+	as_flush_tlb(old);
+	return result;
+#endif
 }
@@ -53,6 +53,7 @@
 #include <vfs.h>
 #include <emufs.h>
 #include "autoconf.h"
+#include "opt-A3.h"
 
 /* Register offsets */
 #define REG_HANDLE    0
@@ -835,6 +836,21 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 	return EUNIMP;
 }
 
+#if OPT_A3
+/*
+ * VOP_MMAP
+ *
+ * Files can be mapped; the page cache reads and writes them with
+ * emufs_read and emufs_write.
+ */
+static
+int
+emufs_mmap(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+#else
 /*
  * VOP_MMAP
  */
@@ -845,6 +861,7 @@ emufs_mmap(struct vnode *v)
 	(void)v;
 	return EUNIMP;
 }
+#endif
 
 //////////////////////////////
 
@@ -44,11 +44,27 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <kmem_cache.h>
+#include <pagecache.h>
+#endif
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+#if OPT_A3
+/*
+ * In-memory vnodes come and go with every open and close of a file
+ * nobody else has open, so keep a few around. Everything in them is
+ * set up in sfs_loadvnode; there's nothing for a constructor to do.
+ */
+static struct kmem_cache sfs_vnode_cache =
+	KMEM_CACHE_INITIALIZER("sfs_vnode", sizeof(struct sfs_vnode),
+			       NULL, NULL, 8);
+#endif
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -953,7 +969,11 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
+#if OPT_A3
+	kmem_cache_free(&sfs_vnode_cache, sv);
+#else
 	kfree(sv);
+#endif
 
 	/* Done */
 	return 0;
@@ -1102,6 +1122,14 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
+#if OPT_A3
+	/* before the biglock: page-ins take the cache lock, then it */
+	result = pagecache_sync(v);
+	if (result) {
+		return result;
+	}
+#endif
+
 	vfs_biglock_acquire();
 	result = sfs_sync_inode(sv);
 	vfs_biglock_release();
@@ -1109,6 +1137,19 @@ sfs_fsync(struct vnode *v)
 	return result;
 }
 
+#if OPT_A3
+/*
+ * Called for mmap(). Any regular file can be mapped; the page cache
+ * does the I/O through sfs_read and sfs_write.
+ */
+static
+int
+sfs_mmap(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+#else
 /*
  * Called for mmap().
  */
@@ -1119,6 +1160,7 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 	(void)v;
 	return EUNIMP;
 }
+#endif
 
 /*
  * Called for ftruncate() and from sfs_reclaim.
@@ -1685,7 +1727,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
+#if OPT_A3
+	sv = kmem_cache_alloc(&sfs_vnode_cache);
+#else
 	sv = kmalloc(sizeof(struct sfs_vnode));
+#endif
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1745,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
+#if OPT_A3
+		kmem_cache_free(&sfs_vnode_cache, sv);
+#else
 		kfree(sv);
+#endif
 		return result;
 	}
 
@@ -1736,7 +1786,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+#if OPT_A3
+		kmem_cache_free(&sfs_vnode_cache, sv);
+#else
 		kfree(sv);
+#endif
 		return result;
 	}
 
@@ -1747,7 +1801,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
+#if OPT_A3
+		kmem_cache_free(&sfs_vnode_cache, sv);
+#else
 		kfree(sv);
+#endif
 		return result;
 	}
 
@@ -36,6 +36,7 @@
 
 
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-A3.h"
 
 struct vnode;
@@ -48,17 +49,59 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_A3
+/*
+ * A region is a range of pages that the program may use, with the
+ * permissions it was defined with (RG_* flags, which match the ELF
+ * PF_* ones). The regions of an address space are kept on a list
+ * sorted by base address. A region with a vnode maps that file,
+ * starting at rg_offset, through the page cache. A region with an
+ * ELF vnode is a program segment whose file part is read into each
+ * page, privately, the first time the page is touched.
+ */
+#define RG_EXEC   0x1
+#define RG_WRITE  0x2
+#define RG_READ   0x4
+
+struct region {
+  vaddr_t rg_vbase;
+  size_t rg_npages;
+  int rg_perms;
+  struct vnode *rg_vnode;
+  off_t rg_offset;
+  struct vnode *rg_elf;
+  vaddr_t rg_elfvaddr;		/* where the file part starts... */
+  off_t rg_elfoffset;		/* ...where it comes from... */
+  size_t rg_elfsize;		/* ...and how long it is */
+  struct region *rg_next;
+};
+#endif
+
 struct addrspace {
   #if OPT_A3
-  int flag;
+  int flag;			/* load complete; enforce RG_WRITE */
 
-  vaddr_t as_vbase1;
-  unsigned int * as_pbase1;
-  size_t as_npages1;
-  vaddr_t as_vbase2;
-  unsigned int * as_pbase2;
-  size_t as_npages2;
-  unsigned int * as_stackpbase;
+  struct region *as_regions;
+  struct region *as_stack;	/* grows down on demand... */
+  size_t as_stackmax;		/* ...to at most this many pages */
+  struct region *as_heap;	/* sbrk heap, just above the program */
+  vaddr_t as_heapbrk;		/* current break, within or at end of it */
+
+  vaddr_t as_lastfault;		/* fault-around stride detector */
+  int as_stride;
+
+  unsigned as_rss;		/* resident pages, under coremap_lock */
+  unsigned as_maxrss;		/* ...and the most there have been */
+
+  /*
+   * Two-level page table: as_pgdir is indexed by the top 10 bits of
+   * the address, and points to second-level tables of 1024 entries
+   * that are only allocated once something in their 4M is touched.
+   */
+  unsigned int **as_pgdir;
+
+  /* TLB address space ID on each CPU, with its generation */
+  uint32_t as_asid[MAXCPUS];
   #else
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -131,9 +174,32 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 #if OPT_A3
-void as_set_segpages(size_t s, unsigned int * pb);
-void as_copy_segpages(size_t sold, unsigned int * pbnew, unsigned int * pbold);
-void as_free_segpages(size_t s, unsigned int * pb);
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * as_sbrk - move the heap break of AS by AMOUNT bytes, handing back
+ *           the old break. Pages above the new break are released.
+ */
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak);
+
+/*
+ * as_mmap   - map LEN bytes of VN, from OFFSET, into AS with the RG_*
+ *             permissions PERMS. Hands back the address chosen.
+ *
+ * as_munmap - remove the mapping that starts at VADDR. Only whole
+ *             mappings can be removed.
+ */
+int as_mmap(struct addrspace *as, struct vnode *vn, off_t offset,
+	    size_t len, int perms, vaddr_t *ret);
+int as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+
+/*
+ * as_define_segment - back the region defined for the program segment
+ *             at VADDR with FILESIZE bytes of V from OFFSET. They are
+ *             read in as the pages are touched.
+ */
+int as_define_segment(struct addrspace *as, struct vnode *v, off_t offset,
+		      vaddr_t vaddr, size_t filesize);
 #endif
 
 #endif /* _ADDRSPACE_H_ */
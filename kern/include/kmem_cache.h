@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A cache holds freed objects of one type so the next allocation can
+ * have one back without going through kmalloc, and without redoing
+ * whatever setup the type needs. The optional constructor runs when
+ * an object is first kmalloc'd and the destructor only when it is
+ * finally kfree'd; in between, objects go back into the cache in
+ * their constructed state (locks unheld, lists empty, and so on), and
+ * kmem_cache_alloc hands them out that way.
+ *
+ * Each cache is a static variable of the module that owns the type,
+ * set up with KMEM_CACHE_INITIALIZER, so it can be used from the
+ * first kmalloc on; it joins the list printed by
+ * kmem_cache_printstats when first used.
+ */
+
+#include <spinlock.h>
+
+/* Most free objects any cache keeps. */
+#define KMEM_CACHE_MAXFREE 16
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);	/* 0 or errno; may be NULL */
+	void (*kc_dtor)(void *obj);	/* may be NULL */
+	unsigned kc_maxfree;		/* at most KMEM_CACHE_MAXFREE */
+
+	struct spinlock kc_lock;	/* for the rest */
+	void *kc_free[KMEM_CACHE_MAXFREE];
+	unsigned kc_nfree;
+	bool kc_listed;			/* on the list of all caches */
+	struct kmem_cache *kc_next;
+
+	unsigned kc_allocs;		/* allocations */
+	unsigned kc_hits;		/* ...served from kc_free */
+	unsigned kc_frees;		/* frees */
+	unsigned kc_kfrees;		/* ...that went to kfree */
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor, maxfree) \
+	{ .kc_name = (name), .kc_size = (size), \
+	  .kc_ctor = (ctor), .kc_dtor = (dtor), .kc_maxfree = (maxfree), \
+	  .kc_lock = SPINLOCK_INITIALIZER }
+
+/* Get a constructed object, or NULL if out of memory. */
+void *kmem_cache_alloc(struct kmem_cache *kc);
+
+/* Give back an object, in its constructed state. */
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+/* Destroy and kfree every object the caches are holding. */
+void kmem_cache_reap(void);
+
+/*
+ * Turn the caches on or off (off: every alloc and free goes straight
+ * to kmalloc and kfree, constructor and destructor included). For
+ * comparing. Returns the old setting.
+ */
+bool kmem_cache_setenabled(bool on);
+
+/* Print the hit rates. */
+void kmem_cache_printstats(void);
+
+#endif /* _KMEM_CACHE_H_ */
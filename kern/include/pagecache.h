@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for mapped files.
+ *
+ * Cached pages are keyed by vnode and page-aligned file offset, so
+ * every mapping of the same part of a file shares one frame. A page
+ * stays in the cache while anything maps it; when the last mapping
+ * goes away it is written back, if it was dirtied, and freed.
+ *
+ * The frames come from alloc_kpages, so they have no owner in the
+ * coremap and are never picked for page-out.
+ */
+
+struct vnode;
+
+void pagecache_bootstrap(void);
+
+/*
+ * Find or read in the page at OFFSET of VN, and take a reference.
+ * If FROMFILE isn't NULL, says whether the page had to be read.
+ */
+int pagecache_get(struct vnode *vn, off_t offset, paddr_t *ret,
+		  bool *fromfile);
+
+/* Note that a mapping of a page is about to be written through. */
+void pagecache_dirty(struct vnode *vn, off_t offset);
+
+/* Drop a reference taken by pagecache_get. */
+void pagecache_release(struct vnode *vn, off_t offset);
+
+/* Write back all dirty pages of VN. */
+int pagecache_sync(struct vnode *vn);
+
+/* Print cache usage. */
+void pagecache_printstats(void);
+
+#endif /* _PAGECACHE_H_ */
@@ -37,6 +37,7 @@
  */
 
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 #if OPT_A2
@@ -90,6 +91,18 @@ struct proc {
 	pid_t pid;
 	struct pidinfo * info;
 	#endif
+
+#if OPT_A3
+	/*
+	 * Fault counts, kept by vm_fault. Only the process's own thread
+	 * updates them, so they take no lock. (The resident set size is
+	 * kept in the address space, since that is what the coremap
+	 * knows about.)
+	 */
+	unsigned p_minflt;		/* faults served without I/O */
+	unsigned p_majflt;		/* faults that read a page in */
+	unsigned p_tlbmiss;		/* TLB misses that got to vm_fault */
+#endif
 #ifdef UW
   /* a vnode to refer to the console device */
   /* this is a quick-and-dirty way to get console writes working */
@@ -119,6 +132,14 @@ struct proc *proc_create_runprogram(const char *name);
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
+#if OPT_A3
+/* Remember an exiting process's memory use, before its space goes. */
+void proc_vmexit(struct proc *proc);
+
+/* Print the memory use and fault counts of every process. */
+void proc_printvmstats(void);
+#endif
+
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAPFILE_H_
+#define _SWAPFILE_H_
+
+/*
+ * Backing store for paged-out user pages.
+ *
+ * The swap area is a raw disk (or a file) carved into page-sized
+ * slots. Slot allocation and all swap I/O are serialized by swap_lock,
+ * which the VM system also holds across a whole page-out or page-in so
+ * that a page can't be faulted back in while it is still being
+ * written.
+ *
+ * Pages that compress well are kept in memory instead of being
+ * written (see zswap.h); the slot is allocated either way.
+ */
+
+struct lock;
+
+/* The device or file to swap to. */
+#define SWAP_PATH "lhd0raw:"
+
+extern struct lock *swap_lock;
+
+/* Open the swap area. Leaves swapping disabled if there isn't one. */
+void swap_bootstrap(void);
+
+/* True if there is a swap area to page out to. */
+bool swap_enabled(void);
+
+/* Slot management. Caller holds swap_lock. */
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+
+/*
+ * Move one page between memory and a slot. Caller holds swap_lock.
+ * If FROMDISK isn't NULL, says whether the page had to be read.
+ */
+int swap_pagein(unsigned slot, paddr_t pa, bool *fromdisk);
+int swap_pageout(unsigned slot, paddr_t pa);
+
+/* Print slot usage. */
+void swap_printstats(void);
+
+#endif /* _SWAPFILE_H_ */
@@ -36,6 +36,15 @@
 
 
 #include <spinlock.h>
+#include "opt-A3.h"
+
+#if OPT_A3
+/*
+ * Names shorter than this are kept in the lock or CV itself; only
+ * longer ones are kstrdup'd.
+ */
+#define SYNCH_NAMELEN 24
+#endif
 
 /*
  * Dijkstra-style semaphore.
@@ -77,6 +86,9 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         volatile struct thread *lk_thread;
+#if OPT_A3
+        char lk_namebuf[SYNCH_NAMELEN];
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -115,6 +127,9 @@ void lock_destroy(struct lock *);
 struct cv {
         char *cv_name;
         struct wchan *cv_wchan;
+#if OPT_A3
+        char cv_namebuf[SYNCH_NAMELEN];
+#endif
 };
 
 struct cv *cv_create(const char *name);
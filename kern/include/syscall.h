@@ -30,6 +30,7 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -47,6 +48,10 @@ void syscall(struct trapframe *tf);
 #if OPT_A2
 void enter_forked_process(void *tf, unsigned long data);
 void remove_unsuccess_child(pid_t pid);
+#if OPT_A3
+/* fork's copies of the parent's trapframe; freed by the child */
+extern struct kmem_cache trapframe_cache;
+#endif
 #else
 void enter_forked_process(struct trapframe *tf);
 #endif
@@ -73,5 +78,9 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 int sys_fork(pid_t *retval, struct trapframe *tf);
 int sys_execv(userptr_t progname, userptr_t args);
 #endif
+#if OPT_A3
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_getrusage(int who, userptr_t usage);
+#endif
 
 #endif /* _SYSCALL_H_ */
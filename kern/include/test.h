@@ -30,6 +30,7 @@
 #ifndef _TEST_H_
 #define _TEST_H_
 #include "opt-A2.h"
+#include "opt-A3.h"
 /*
  * Declarations for test code and other miscellaneous high-level
  * functions.
@@ -81,6 +82,17 @@ int malloctest(int, char **);
 int mallocstress(int, char **);
 int nettest(int, char **);
 
+#if OPT_A3
+/* VM benchmarks */
+int refillbench(int, char **);
+int execbench(int, char **);
+int swapbench(int, char **);
+int forkbench(int, char **);
+
+/* mapped file test */
+int mmaptest(int, char **);
+#endif
+
 /* Routine for running a user-level program. */
 #if OPT_A2
 int runprogram(char *progname, unsigned long num, char ** args);
@@ -39,6 +39,7 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include "opt-A3.h"
 
 struct cpu;
 
@@ -105,6 +106,15 @@ struct thread {
 	 * Public fields
 	 */
 
+#if OPT_A3
+	/*
+	 * User stack pointer as of the last trap from user mode, or
+	 * while exec copies the arguments out. The user stack only
+	 * grows to just below it (see as_grow_stack).
+	 */
+	vaddr_t t_usersp;
+#endif
+
 	/* add more here as needed */
 };
 
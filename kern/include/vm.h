@@ -64,6 +64,42 @@ unsigned int get_page_num(vaddr_t vad, vaddr_t vbase);
 paddr_t get_page_offset(vaddr_t vad, vaddr_t vbase);
 paddr_t get_paddr(unsigned int i);
 unsigned int get_frame_num(paddr_t pad);
+
+/* Print physical page allocator statistics (kmem menu command) */
+void coremap_printstats(void);
+
+/* A zero-filled kernel page, from the pool idle CPUs keep filled */
+vaddr_t alloc_kpage_zeroed(void);
+bool vm_idlezero(void);
+void vm_setzeropool(unsigned low, unsigned high);
+
+/* kmalloc's record of a subpage page, by page (see dumbvm.c) */
+void kpage_setref(vaddr_t kva, void *ref);
+bool kpage_getref(vaddr_t kva, void **ref);
+
+/* kmalloc's per-CPU magazines on or off (for comparing) */
+void kmalloc_setmagazines(bool on);
+
+/* Give back what the depot and this CPU's magazines hold (out of memory) */
+void kmag_reap(void);
+
+/* kmalloc's allocation profiler on (starting afresh) or off, and its report */
+void kmalloc_setprofile(bool on);
+void kmalloc_printprofile(void);
+
+/* TLB refill benchmarking hooks */
+void vm_setfastrefill(bool on);
+void vm_tlbflush(void);
+
+/* Load programs on demand, or all at exec (for benchmarking) */
+void vm_setdemandload(bool on);
+
+/* Resident pages to load into the TLB along a fault stride (0: off) */
+void vm_setfaultaround(unsigned npages);
+
+/* Background merging of identical user pages (frames per second, 0: off) */
+void vm_mergestart(void);
+void vm_setmerge(unsigned nframes);
 #endif
 
 #endif /* _VM_H_ */
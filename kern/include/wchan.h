@@ -34,6 +34,7 @@
  * Wait channel.
  */
 
+#include "opt-A3.h"
 
 struct wchan; /* Opaque */
 
@@ -49,6 +50,14 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+#if OPT_A3
+/*
+ * Give a wait channel a new NAME (same rules as for wchan_create),
+ * for one kept in an object that is being reused.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+#endif
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+/*
+ * Compressed swap pool.
+ *
+ * Sits in front of the swap area: a page being paged out is first
+ * compressed into kernel memory, and only written to disk if it
+ * doesn't compress to half a page or the pool is full. Entries are
+ * keyed by swap slot, so the slot stays allocated (and its page
+ * table entry unchanged) while the page lives in the pool, and goes
+ * away when the slot is freed.
+ *
+ * Callers hold swap_lock, except to change the limit or print stats.
+ */
+
+/* Set up for a swap area of NSLOTS slots. */
+void zswap_bootstrap(unsigned nslots);
+
+/* Keep the page at PA as SLOT, if it compresses. True if it did. */
+bool zswap_store(unsigned slot, paddr_t pa);
+
+/* Read SLOT into PA if it's in the pool. True if it was. */
+bool zswap_load(unsigned slot, paddr_t pa);
+
+/* SLOT is being freed; let go of its copy, if any. */
+void zswap_drop(unsigned slot);
+
+/*
+ * Set how many pages' worth of compressed data the pool may hold
+ * (0: off, everything goes to disk). Returns the old limit.
+ */
+unsigned zswap_setmax(unsigned npages);
+
+/* Print pool usage. */
+void zswap_printstats(void);
+
+#endif /* _ZSWAP_H_ */
@@ -61,6 +61,43 @@ struct cv *cvpid = NULL;
 static pid_t ccc = 1;
 #endif
 
+#if OPT_A3
+#include <array.h>
+/* every process but kproc, for proc_printvmstats */
+static struct array *allprocs;
+static struct lock *allprocs_lock;
+
+/* ...and the last few to exit, since the menu waits for them */
+#define PROC_NEXITED 16
+
+struct procvmstat {
+	pid_t pv_pid;
+	char pv_name[16];
+	unsigned pv_maxrss;
+	unsigned pv_minflt;
+	unsigned pv_majflt;
+	unsigned pv_tlbmiss;
+};
+
+static struct procvmstat exited[PROC_NEXITED];
+static unsigned nexited;	/* ever; the next goes in nexited % N */
+
+#include <kmem_cache.h>
+/*
+ * Caches for proc and pidinfo structures. A cached proc has its lock
+ * and an empty thread array (which keeps whatever space it had).
+ */
+static int proc_ctor(void *obj);
+static void proc_dtor(void *obj);
+
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc),
+			       proc_ctor, proc_dtor, KMEM_CACHE_MAXFREE);
+static struct kmem_cache pidinfo_cache =
+	KMEM_CACHE_INITIALIZER("pidinfo", sizeof(struct pidinfo),
+			       NULL, NULL, KMEM_CACHE_MAXFREE);
+#endif
+
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
@@ -83,7 +120,11 @@ struct semaphore *no_proc_sem;
 struct pidinfo *
 pidinfo_create(pid_t pid){
 	struct pidinfo *pidinfo;
+#if OPT_A3
+	pidinfo = kmem_cache_alloc(&pidinfo_cache);
+#else
 	pidinfo = kmalloc(sizeof(*pidinfo));
+#endif
 	pidinfo->pid = pid;
 	pidinfo->parent = 0;
 	pidinfo->exitalready = 0;
@@ -95,7 +136,11 @@ void
 pidinfo_destroy(struct pidinfo *pidinfo){
 	KASSERT(pidinfo != NULL);
 
+#if OPT_A3
+	kmem_cache_free(&pidinfo_cache, pidinfo);
+#else
 	kfree(pidinfo);
+#endif
 }
 
 pid_t create_pid(void){
@@ -110,6 +155,29 @@ pid_t create_pid(void){
 }
 #endif
 
+#if OPT_A3
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+#endif
+
 /*
  * Create a proc structure.
  */
@@ -119,21 +187,37 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
+#if OPT_A3
+	proc = kmem_cache_alloc(&proc_cache);
+#else
 	proc = kmalloc(sizeof(*proc));
+#endif
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
+#if OPT_A3
+		kmem_cache_free(&proc_cache, proc);
+#else
 		kfree(proc);
+#endif
 		return NULL;
 	}
 
+#if !OPT_A3
+	/* (the cache's constructor did these) */
 	threadarray_init(&proc->p_threads);
 	spinlock_init(&proc->p_lock);
+#endif
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+#if OPT_A3
+	proc->p_minflt = 0;
+	proc->p_majflt = 0;
+	proc->p_tlbmiss = 0;
+#endif
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -162,6 +246,17 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+#if OPT_A3
+	lock_acquire(allprocs_lock);
+	for (unsigned i = 0; i < array_num(allprocs); i++) {
+		if (array_get(allprocs, i) == proc) {
+			array_remove(allprocs, i);
+			break;
+		}
+	}
+	lock_release(allprocs_lock);
+#endif
+
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
@@ -201,11 +296,19 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
+#if OPT_A3
+	/* back to the cache with its lock and (empty) thread array */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	KASSERT(!spinlock_do_i_hold(&proc->p_lock));
+	kfree(proc->p_name);
+	kmem_cache_free(&proc_cache, proc);
+#else
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
 	kfree(proc);
+#endif
 
 #ifdef UW
 	/* decrement the process count */
@@ -253,6 +356,13 @@ proc_bootstrap(void)
   cvpid = cv_create("cvpid");
 #endif
 #endif // UW 
+#if OPT_A3
+  allprocs = array_create();
+  allprocs_lock = lock_create("allprocs");
+  if (allprocs == NULL || allprocs_lock == NULL) {
+    panic("could not create the process list\n");
+  }
+#endif
 }
 
 /*
@@ -324,10 +434,94 @@ proc_create_runprogram(const char *name)
   	proc->info = pidinfo_create(proc->pid);
   	array_add(pidarr, proc->info, NULL);
   	lock_release(globalarrs);
+#endif
+#if OPT_A3
+	/* if there's no room, it just doesn't get listed */
+	lock_acquire(allprocs_lock);
+	array_add(allprocs, proc, NULL);
+	lock_release(allprocs_lock);
 #endif
   return proc;
 }
 
+#if OPT_A3
+/*
+ * Called by sys__exit while PROC still has its address space.
+ */
+void
+proc_vmexit(struct proc *proc)
+{
+	struct procvmstat *pv;
+
+	lock_acquire(allprocs_lock);
+	pv = &exited[nexited++ % PROC_NEXITED];
+#if OPT_A2
+	pv->pv_pid = proc->pid;
+#else
+	pv->pv_pid = -1;
+#endif
+	if (strlen(proc->p_name) < sizeof(pv->pv_name)) {
+		strcpy(pv->pv_name, proc->p_name);
+	}
+	else {
+		memcpy(pv->pv_name, proc->p_name, sizeof(pv->pv_name) - 1);
+		pv->pv_name[sizeof(pv->pv_name) - 1] = 0;
+	}
+	pv->pv_maxrss = proc->p_addrspace != NULL ?
+		proc->p_addrspace->as_maxrss : 0;
+	pv->pv_minflt = proc->p_minflt;
+	pv->pv_majflt = proc->p_majflt;
+	pv->pv_tlbmiss = proc->p_tlbmiss;
+	lock_release(allprocs_lock);
+}
+
+/*
+ * Print every process's resident set (current and largest, in pages)
+ * and fault counts, then those of the last few to exit. The numbers
+ * are a snapshot and aren't locked; the address space is only looked
+ * at under p_lock, which keeps it from being taken away (and
+ * destroyed) meanwhile.
+ */
+void
+proc_printvmstats(void)
+{
+	struct procvmstat *pv;
+	struct proc *p;
+	struct addrspace *as;
+	unsigned rss, maxrss, first;
+
+	kprintf("  pid      rss   maxrss   minflt   majflt  tlbmiss  name\n");
+	lock_acquire(allprocs_lock);
+	for (unsigned i = 0; i < array_num(allprocs); i++) {
+		p = array_get(allprocs, i);
+
+		spinlock_acquire(&p->p_lock);
+		as = p->p_addrspace;
+		rss = as != NULL ? as->as_rss : 0;
+		maxrss = as != NULL ? as->as_maxrss : 0;
+		spinlock_release(&p->p_lock);
+
+		kprintf("%5d %8u %8u %8u %8u %8u  %s\n",
+#if OPT_A2
+			(int)p->pid,
+#else
+			-1,
+#endif
+			rss, maxrss, p->p_minflt, p->p_majflt,
+			p->p_tlbmiss, p->p_name);
+	}
+
+	first = nexited > PROC_NEXITED ? nexited - PROC_NEXITED : 0;
+	for (unsigned i = first; i < nexited; i++) {
+		pv = &exited[i % PROC_NEXITED];
+		kprintf("%5d   exited %8u %8u %8u %8u  %s\n",
+			(int)pv->pv_pid, pv->pv_maxrss, pv->pv_minflt,
+			pv->pv_majflt, pv->pv_tlbmiss, pv->pv_name);
+	}
+	lock_release(allprocs_lock);
+}
+#endif
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -49,7 +49,9 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
 
 
 /*
@@ -125,6 +127,9 @@ boot(void)
 	vm_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
+#if OPT_A3
+	vm_mergestart();
+#endif
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
@@ -146,6 +151,10 @@ shutdown(void)
 {
 
 	kprintf("Shutting down.\n");
+
+#if OPT_A3
+	vmstats_print();
+#endif
 	
 	vfs_clearbootfs();
 	vfs_clearcurdir();
@@ -42,10 +42,15 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-A2.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <zswap.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -421,6 +426,143 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_A3
+static
+int
+cmd_kmemstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for setting the pre-zeroed page pool's watermarks.
+ */
+static
+int
+cmd_zeropool(int nargs, char **args)
+{
+	if (nargs != 3) {
+		kprintf("Usage: zp low high\n");
+		return EINVAL;
+	}
+
+	vm_setzeropool(atoi(args[1]), atoi(args[2]));
+
+	return 0;
+}
+
+/*
+ * Command for printing each process's memory use and faults.
+ */
+static
+int
+cmd_ps(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printvmstats();
+
+	return 0;
+}
+
+/*
+ * Command for setting how many pages a fault loads around itself.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: fa npages\n");
+		return EINVAL;
+	}
+
+	vm_setfaultaround(atoi(args[1]));
+
+	return 0;
+}
+
+/*
+ * Command for setting how fast the page merger scans memory.
+ */
+static
+int
+cmd_merge(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: sm framespersec\n");
+		return EINVAL;
+	}
+
+	vm_setmerge(atoi(args[1]));
+
+	return 0;
+}
+
+/*
+ * Command for setting the size of the compressed swap pool.
+ */
+static
+int
+cmd_zswap(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: zs maxpages\n");
+		return EINVAL;
+	}
+
+	zswap_setmax(atoi(args[1]));
+
+	return 0;
+}
+
+/*
+ * Command for turning kmalloc's per-CPU magazines on and off.
+ */
+static
+int
+cmd_kmag(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: kmag 0|1\n");
+		return EINVAL;
+	}
+
+	kmalloc_setmagazines(atoi(args[1]) != 0);
+
+	return 0;
+}
+
+/*
+ * Command for the kmalloc profiler: turn it on or off, or with no
+ * argument print what it has.
+ */
+static
+int
+cmd_kprof(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: kprof [0|1]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		kmalloc_setprofile(atoi(args[1]) != 0);
+	}
+	else {
+		kmalloc_printprofile();
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -500,6 +642,13 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+#if OPT_A3
+	"[vb1] TLB refill benchmark          ",
+	"[vb2] Exec latency benchmark        ",
+	"[vb3] Compressed swap benchmark     ",
+	"[vb4] Fork/exit benchmark           ",
+	"[mm]  Mapped file test              ",
+#endif
 	NULL
 };
 
@@ -531,6 +680,16 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_A3
+	"[kmem] Physical memory stats        ",
+	"[zp] Set zero pool watermarks       ",
+	"[fa] Set fault-around pages         ",
+	"[ps] Process memory and faults      ",
+	"[sm] Set page merger scan rate      ",
+	"[zs] Set compressed swap pool size  ",
+	"[kmag] kmalloc magazines on/off     ",
+	"[kprof] kmalloc profiler on/off/show",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -588,6 +747,16 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_A3
+	{ "kmem",       cmd_kmemstats },
+	{ "zp",         cmd_zeropool },
+	{ "fa",         cmd_faultaround },
+	{ "ps",         cmd_ps },
+	{ "sm",         cmd_merge },
+	{ "zs",         cmd_zswap },
+	{ "kmag",       cmd_kmag },
+	{ "kprof",      cmd_kprof },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -617,6 +786,15 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
 
+#if OPT_A3
+	/* VM benchmarks */
+	{ "vb1",	refillbench },
+	{ "vb2",	execbench },
+	{ "vb3",	swapbench },
+	{ "vb4",	forkbench },
+	{ "mm",		mmaptest },
+#endif
+
 	{ NULL, NULL }
 };
 
@@ -2,6 +2,8 @@
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
 #include <syscall.h>
 #include <current.h>
@@ -11,11 +13,19 @@
 #include <copyinout.h>
 #include <synch.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 #if OPT_A2
 #include <mips/trapframe.h>
 #include <limits.h>
 #include <kern/fcntl.h>
 #include <vfs.h>
+#endif
+#if OPT_A2 && OPT_A3
+#include <kmem_cache.h>
+
+struct kmem_cache trapframe_cache =
+	KMEM_CACHE_INITIALIZER("trapframe", sizeof(struct trapframe),
+			       NULL, NULL, KMEM_CACHE_MAXFREE);
 #endif
 
   /* this implementation of sys__exit does not do anything with the exit code */
@@ -100,6 +110,9 @@ void sys__exit(int exitcode) {
    * half-destroyed address space. This tends to be
    * messily fatal.
    */
+#if OPT_A3
+  proc_vmexit(curproc);
+#endif
   as = curproc_setas(NULL);
   as_destroy(as);
 
@@ -274,7 +287,11 @@ sys_fork(pid_t *retval, struct trapframe *tf){
   //         modify the trapframe, 
   //         call mips_usermode to go back to userspace.
   struct trapframe *tfcopy ;
+#if OPT_A3
+  tfcopy = kmem_cache_alloc(&trapframe_cache);
+#else
   tfcopy = kmalloc(sizeof(*tfcopy));
+#endif
   if(tfcopy == NULL){
     remove_unsuccess_child(p->pid);
     kfree(ret);
@@ -285,7 +302,11 @@ sys_fork(pid_t *retval, struct trapframe *tf){
   s = thread_fork("newthr", p, enter_forked_process, tfcopy, 0);
   if(s != 0){
     remove_unsuccess_child(p->pid);
+#if OPT_A3
+    kmem_cache_free(&trapframe_cache, tfcopy);
+#else
     kfree(tfcopy);
+#endif
     kfree(ret);
     proc_destroy(p);
     return ENOMEM;
@@ -461,6 +482,9 @@ int sys_execv(userptr_t progname, userptr_t args){
   for(unsigned long i = 0; i < num; i++){
     len = strlen(copyargs[i]) + 1;
     stackptr = stackptr - ROUNDUP(len, 8);//? limit or valid stackptr
+#if OPT_A3
+    curthread->t_usersp = stackptr;
+#endif
     result = copyoutstr(copyargs[i], (userptr_t)stackptr, len, NULL);
     if(result){
       // free
@@ -477,6 +501,9 @@ int sys_execv(userptr_t progname, userptr_t args){
   // copy arr
   len = sizeof(char *) * (num + 1);
   stackptr = stackptr - ROUNDUP(len, 8);
+#if OPT_A3
+  curthread->t_usersp = stackptr;
+#endif
   result = copyout(copyargs, (userptr_t)stackptr, len);
   if(result){
     kfree(copyargs);
@@ -501,3 +528,41 @@ int sys_execv(userptr_t progname, userptr_t args){
 }
 
 #endif
+
+#if OPT_A3
+/* move the heap break; hands back the old one, like sbrk(2) */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+  struct addrspace *as = curproc_getas();
+
+  if(as == NULL){
+    return ENOMEM;
+  }
+  return as_sbrk(as, amount, retval);
+}
+
+/*
+ * getrusage: only RUSAGE_SELF, and only the memory numbers. The
+ * current resident set and the TLB misses have no place in struct
+ * rusage; the "ps" menu command shows those.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+  struct addrspace *as = curproc_getas();
+  struct rusage ru;
+
+  if(who != RUSAGE_SELF){
+    return EINVAL;
+  }
+
+  bzero(&ru, sizeof(ru));
+  if(as != NULL){
+    ru.ru_maxrss = as->as_maxrss * (PAGE_SIZE / 1024);
+  }
+  ru.ru_minflt = curproc->p_minflt;
+  ru.ru_majflt = curproc->p_majflt;
+  return copyout(&ru, usage, sizeof(ru));
+}
+#endif
@@ -45,6 +45,7 @@
 #include <syscall.h>
 #include <test.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 #if OPT_A2
 #include <copyinout.h>
 #endif
@@ -117,6 +118,9 @@ runprogram(char *progname)
  	for(unsigned long int i = 0; i < num; i++){
     	len = strlen(args[i]) + 1;
     	stackptr = stackptr - ROUNDUP(len, 8);//? limit or valid stackptr //new
+#if OPT_A3
+    	curthread->t_usersp = stackptr;
+#endif
 
     	result = copyoutstr(args[i], (userptr_t)stackptr, len, NULL);//new
     	if(result){
@@ -131,6 +135,9 @@ runprogram(char *progname)
   	// copy arr
   	len = sizeof(char *) * (num + 1);
  	stackptr = stackptr - ROUNDUP(len, 8);
+#if OPT_A3
+  	curthread->t_usersp = stackptr;
+#endif
   	result = copyout(copyargs, (userptr_t)stackptr, len);
   	kfree(copyargs);
   	if(result){
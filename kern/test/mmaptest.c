@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest - test of mapped files.
+ *
+ * Writes a file of MMT_NPAGES pages, maps it into a scratch address
+ * space, checks every word through the mapping and changes them all,
+ * syncs it (what msync would do) and unmaps it, then reads the file
+ * back with VOP_READ and complains if the changes didn't get there.
+ * The first touch of each page reads it in through the page cache,
+ * the first write marks it dirty there, and the sync writes it back
+ * through sfs.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define MMT_FILENAME "mmaptest.tmp"
+#define MMT_NPAGES   3
+#define MMT_MASK     0x5a5a5a5a
+#define MMT_NWORDS   (PAGE_SIZE / sizeof(uint32_t))
+
+/* what word I of page P starts out as */
+#define MMT_WORD(p, i) (((uint32_t)(p) << 16) | (i))
+
+static
+int
+mmt_io(struct vnode *vn, uint32_t *buf, unsigned page, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, buf, PAGE_SIZE, (off_t)page * PAGE_SIZE, rw);
+	result = rw == UIO_READ ? VOP_READ(vn, &ku) : VOP_WRITE(vn, &ku);
+	if (result == 0 && ku.uio_resid > 0) {
+		result = EIO;
+	}
+	return result;
+}
+
+/*
+ * Check and change every word through the mapping at VA.
+ */
+static
+int
+mmt_touch(vaddr_t va)
+{
+	volatile uint32_t *p;
+	unsigned pg, i;
+
+	for (pg = 0; pg < MMT_NPAGES; pg++) {
+		p = (volatile uint32_t *)(va + pg * PAGE_SIZE);
+		for (i = 0; i < MMT_NWORDS; i++) {
+			if (p[i] != MMT_WORD(pg, i)) {
+				kprintf("mmaptest: page %u word %u is 0x%x "
+					"through the mapping\n", pg, i, p[i]);
+				return EIO;
+			}
+			p[i] ^= MMT_MASK;
+		}
+	}
+	return 0;
+}
+
+int
+mmaptest(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	struct vnode *vn;
+	char name[64];
+	uint32_t *buf;
+	vaddr_t va;
+	unsigned pg, i;
+	bool mapped = false;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: mm filesystem:\n");
+		return EINVAL;
+	}
+	/* Allow (but do not require) colon after device name */
+	if (args[1][strlen(args[1])-1] == ':') {
+		args[1][strlen(args[1])-1] = 0;
+	}
+	snprintf(name, sizeof(name), "%s:%s", args[1], MMT_FILENAME);
+
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	as = as_create();
+	if (as == NULL) {
+		kfree(buf);
+		return ENOMEM;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	strcpy((char *)buf, name);
+	result = vfs_open((char *)buf, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (result) {
+		kprintf("mmaptest: %s: %s\n", name, strerror(result));
+		as_destroy(as);
+		kfree(buf);
+		return result;
+	}
+
+	for (pg = 0; pg < MMT_NPAGES && result == 0; pg++) {
+		for (i = 0; i < MMT_NWORDS; i++) {
+			buf[i] = MMT_WORD(pg, i);
+		}
+		result = mmt_io(vn, buf, pg, UIO_WRITE);
+	}
+	if (result) {
+		kprintf("mmaptest: write: %s\n", strerror(result));
+		goto out;
+	}
+
+	oldas = curproc_setas(as);
+	as_activate();
+	result = as_mmap(as, vn, 0, MMT_NPAGES * PAGE_SIZE,
+			 RG_READ | RG_WRITE, &va);
+	if (result == 0) {
+		mapped = true;
+		result = mmt_touch(va);
+	}
+	if (result == 0) {
+		result = VOP_FSYNC(vn);
+	}
+	if (mapped) {
+		as_munmap(as, va, MMT_NPAGES * PAGE_SIZE);
+	}
+	as_deactivate();
+	curproc_setas(oldas);
+	as_activate();
+	if (result) {
+		kprintf("mmaptest: mapping: %s\n", strerror(result));
+		goto out;
+	}
+
+	for (pg = 0; pg < MMT_NPAGES; pg++) {
+		result = mmt_io(vn, buf, pg, UIO_READ);
+		if (result) {
+			kprintf("mmaptest: read: %s\n", strerror(result));
+			goto out;
+		}
+		for (i = 0; i < MMT_NWORDS; i++) {
+			if (buf[i] != (MMT_WORD(pg, i) ^ MMT_MASK)) {
+				kprintf("mmaptest: page %u word %u is 0x%x "
+					"in the file\n", pg, i, buf[i]);
+				result = EIO;
+				goto out;
+			}
+		}
+	}
+	kprintf("mmaptest: %u pages written through the mapping\n",
+		MMT_NPAGES);
+
+ out:
+	vfs_close(vn);
+	vfs_remove(name);
+	as_destroy(as);
+	kfree(buf);
+	if (result == 0) {
+		kprintf("mmaptest done.\n");
+	}
+	return result;
+}
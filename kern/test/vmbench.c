@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * VM benchmarks.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vfs.h>
+#include <synch.h>
+#include <vm.h>
+#include <swapfile.h>
+#include <zswap.h>
+#include <kmem_cache.h>
+#include <test.h>
+
+/*
+ * Start timing.
+ */
+static
+void
+bench_start(time_t *secs, uint32_t *nsecs)
+{
+	gettime(secs, nsecs);
+}
+
+/*
+ * Microseconds since bench_start.
+ */
+static
+uint32_t
+bench_stop(time_t secs, uint32_t nsecs)
+{
+	time_t nowsecs, rsecs;
+	uint32_t nownsecs, rnsecs;
+
+	gettime(&nowsecs, &nownsecs);
+	getinterval(secs, nsecs, nowsecs, nownsecs, &rsecs, &rnsecs);
+	return rsecs * 1000000 + rnsecs / 1000;
+}
+
+/*
+ * Nanoseconds per operation, given N operations took US microseconds.
+ */
+static
+uint32_t
+bench_per_op(uint32_t us, uint32_t n)
+{
+	if (us < 4000000) {
+		return us * 1000 / n;
+	}
+	return us / n * 1000;
+}
+
+////////////////////////////////////////////////////////////
+//
+// TLB refill latency.
+//
+// Map REFILL_NPAGES pages into a scratch address space and touch them
+// once so they are resident. Then time REFILL_ROUNDS rounds of
+// emptying the TLB and reading one word from each page, so that every
+// read is a TLB miss on a page that is already there. Emptying the TLB
+// is timed on its own and subtracted. This is done with the fast
+// refill path in exception-mips1.S turned off, then on.
+//
+
+#define REFILL_BASE    0x10000000
+#define REFILL_NPAGES  48		/* fewer than NUM_TLB */
+#define REFILL_ROUNDS  100
+
+static
+uint32_t
+refill_rounds(bool touch)
+{
+	volatile int *p;
+	time_t secs;
+	uint32_t nsecs;
+	int r, i;
+
+	bench_start(&secs, &nsecs);
+	for (r = 0; r < REFILL_ROUNDS; r++) {
+		vm_tlbflush();
+		if (!touch) {
+			continue;
+		}
+		for (i = 0; i < REFILL_NPAGES; i++) {
+			p = (volatile int *)(REFILL_BASE + i * PAGE_SIZE);
+			(void)*p;
+		}
+	}
+	return bench_stop(secs, nsecs);
+}
+
+int
+refillbench(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	uint32_t flushus, slowus, fastus, n;
+	volatile int *p;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	as = as_create();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	result = as_define_region(as, REFILL_BASE, REFILL_NPAGES * PAGE_SIZE,
+				  1, 1, 0);
+	if (result) {
+		as_destroy(as);
+		return result;
+	}
+
+	oldas = curproc_setas(as);
+	as_activate();
+
+	/* fault everything in; that isn't what we're measuring */
+	for (i = 0; i < REFILL_NPAGES; i++) {
+		p = (volatile int *)(REFILL_BASE + i * PAGE_SIZE);
+		*p = i;
+	}
+
+	flushus = refill_rounds(false);
+	vm_setfastrefill(false);
+	slowus = refill_rounds(true);
+	vm_setfastrefill(true);
+	fastus = refill_rounds(true);
+
+	as_deactivate();
+	curproc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+	/* the fast path may have been too quick to see */
+	slowus = slowus > flushus ? slowus - flushus : 0;
+	fastus = fastus > flushus ? fastus - flushus : 0;
+	n = REFILL_ROUNDS * REFILL_NPAGES;
+
+	kprintf("TLB refill, %u misses each way:\n", n);
+	kprintf("  mips_trap/vm_fault: %u us, %u ns per miss\n",
+		slowus, bench_per_op(slowus, n));
+	kprintf("  UTLB fast path:     %u us, %u ns per miss\n",
+		fastus, bench_per_op(fastus, n));
+	kprintf("refillbench done.\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Exec latency.
+//
+// Time EXEC_ROUNDS rounds of what runprogram does before the program
+// gets to run -- open it, load it into a fresh address space, set up
+// the stack -- with programs read in at exec, then loaded on demand.
+// The address spaces are thrown away untouched, so with demand
+// loading this leaves out the page-ins the program would go on to do.
+//
+
+#define EXEC_ROUNDS    20
+#define EXEC_DEFPROG   "/testbin/palin"
+
+static
+int
+exec_rounds(const char *prog, uint32_t *us)
+{
+	struct addrspace *as, *oldas;
+	struct vnode *v;
+	vaddr_t entrypoint, stackptr;
+	char path[128];
+	time_t secs;
+	uint32_t nsecs;
+	int r, result;
+
+	*us = 0;
+	for (r = 0; r < EXEC_ROUNDS; r++) {
+		as = as_create();
+		if (as == NULL) {
+			return ENOMEM;
+		}
+		oldas = curproc_setas(as);
+		as_activate();
+
+		bench_start(&secs, &nsecs);
+		/* vfs_open may scribble on the path */
+		strcpy(path, prog);
+		result = vfs_open(path, O_RDONLY, 0, &v);
+		if (result == 0) {
+			result = load_elf(v, &entrypoint);
+			vfs_close(v);
+		}
+		if (result == 0) {
+			result = as_define_stack(as, &stackptr);
+		}
+		*us += bench_stop(secs, nsecs);
+
+		as_deactivate();
+		curproc_setas(oldas);
+		as_activate();
+		as_destroy(as);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+int
+execbench(int nargs, char **args)
+{
+	const char *prog = EXEC_DEFPROG;
+	uint32_t eagerus, demandus;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: vb2 [program]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		prog = args[1];
+	}
+	if (strlen(prog) >= 128) {
+		return ENAMETOOLONG;
+	}
+
+	vm_setdemandload(false);
+	result = exec_rounds(prog, &eagerus);
+	vm_setdemandload(true);
+	if (result) {
+		kprintf("execbench: %s: %s\n", prog, strerror(result));
+		return result;
+	}
+	result = exec_rounds(prog, &demandus);
+	if (result) {
+		kprintf("execbench: %s: %s\n", prog, strerror(result));
+		return result;
+	}
+
+	kprintf("Exec of %s, %u times each way:\n", prog, EXEC_ROUNDS);
+	kprintf("  read at exec:       %u us, %u us per exec\n",
+		eagerus, eagerus / EXEC_ROUNDS);
+	kprintf("  loaded on demand:   %u us, %u us per exec\n",
+		demandus, demandus / EXEC_ROUNDS);
+	kprintf("execbench done.\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Swap latency.
+//
+// Time SWAP_ROUNDS round trips of one page through the swap layer --
+// page it out to a fresh slot, page it back in, free the slot -- with
+// the compressed pool in front of the disk, then with the pool off.
+// This is done for a page of zeros, a page of small integers (like a
+// typical data page) and a page of noise, which doesn't compress and
+// so goes to disk either way. Every page that comes back is checked.
+//
+
+#define SWAP_ROUNDS    32
+
+static const char *const swap_kinds[] = { "zeros ", "ints  ", "noise " };
+
+static
+void
+swap_fill(uint32_t *p, unsigned kind)
+{
+	uint32_t seed = 12345;
+	unsigned i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		switch (kind) {
+		    case 0:
+			p[i] = 0;
+			break;
+		    case 1:
+			p[i] = i % 100;
+			break;
+		    default:
+			seed = seed * 1103515245 + 12345;
+			p[i] = seed;
+			break;
+		}
+	}
+}
+
+static
+int
+swap_rounds(paddr_t src, paddr_t dst, uint32_t *us)
+{
+	const uint32_t *p1 = (const uint32_t *)PADDR_TO_KVADDR(src);
+	const uint32_t *p2 = (const uint32_t *)PADDR_TO_KVADDR(dst);
+	time_t secs;
+	uint32_t nsecs;
+	unsigned slot, i;
+	int r, result;
+
+	lock_acquire(swap_lock);
+	bench_start(&secs, &nsecs);
+	for (r = 0; r < SWAP_ROUNDS; r++) {
+		result = swap_alloc(&slot);
+		if (result) {
+			lock_release(swap_lock);
+			return result;
+		}
+		result = swap_pageout(slot, src);
+		if (result == 0) {
+			result = swap_pagein(slot, dst, NULL);
+		}
+		swap_free(slot);
+		if (result) {
+			lock_release(swap_lock);
+			return result;
+		}
+	}
+	*us = bench_stop(secs, nsecs);
+	lock_release(swap_lock);
+
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (p1[i] != p2[i]) {
+			kprintf("swapbench: word %u came back wrong\n", i);
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+int
+swapbench(int nargs, char **args)
+{
+	vaddr_t srcva, dstva;
+	uint32_t poolus, diskus;
+	unsigned kind, oldmax;
+	int result = 0;
+
+	(void)nargs;
+	(void)args;
+
+	if (!swap_enabled()) {
+		kprintf("swapbench: no swap area\n");
+		return ENOSYS;
+	}
+	srcva = alloc_kpages(1);
+	dstva = alloc_kpages(1);
+	if (srcva == 0 || dstva == 0) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	kprintf("Swap round trips, %u of each kind each way:\n",
+		SWAP_ROUNDS);
+	kprintf("  page          with pool         disk only\n");
+	for (kind = 0; kind < 3; kind++) {
+		swap_fill((uint32_t *)srcva, kind);
+
+		/* no limit, so that whatever is in the pool can't matter */
+		oldmax = zswap_setmax((unsigned)-1 / PAGE_SIZE);
+		result = swap_rounds(KVADDR_TO_PADDR(srcva),
+				     KVADDR_TO_PADDR(dstva), &poolus);
+		zswap_setmax(0);
+		if (result == 0) {
+			result = swap_rounds(KVADDR_TO_PADDR(srcva),
+					     KVADDR_TO_PADDR(dstva), &diskus);
+		}
+		zswap_setmax(oldmax);
+		if (result) {
+			kprintf("swapbench: %s\n", strerror(result));
+			goto out;
+		}
+		kprintf("  %s %9u us/page %9u us/page\n", swap_kinds[kind],
+			poolus / SWAP_ROUNDS, diskus / SWAP_ROUNDS);
+	}
+	zswap_printstats();
+	kprintf("swapbench done.\n");
+
+ out:
+	if (srcva != 0) {
+		free_kpages(srcva);
+	}
+	if (dstva != 0) {
+		free_kpages(dstva);
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Thread fork/exit latency.
+//
+// Time FORK_ROUNDS rounds of forking a kernel thread that does nothing
+// but V a semaphore and exit, waiting for each one before forking the
+// next, so its thread and stack are given back in time to be reused.
+// Then time as many rounds of creating and destroying a lock and a
+// CV. Both are done with the object caches off, then on. (A user
+// fork/exit also goes through the proc, pidinfo and trapframe caches,
+// but needs a user program to drive it.)
+//
+
+#define FORK_ROUNDS    200
+
+static
+void
+fork_child(void *sem, unsigned long junk)
+{
+	(void)junk;
+	V(sem);
+}
+
+static
+int
+fork_rounds(struct semaphore *sem, uint32_t *forkus, uint32_t *synchus)
+{
+	struct lock *lk;
+	struct cv *cv;
+	time_t secs;
+	uint32_t nsecs;
+	int r, result;
+
+	bench_start(&secs, &nsecs);
+	for (r = 0; r < FORK_ROUNDS; r++) {
+		result = thread_fork("forkbench", NULL, fork_child, sem, 0);
+		if (result) {
+			return result;
+		}
+		P(sem);
+	}
+	*forkus = bench_stop(secs, nsecs);
+
+	bench_start(&secs, &nsecs);
+	for (r = 0; r < FORK_ROUNDS; r++) {
+		lk = lock_create("forkbench");
+		cv = cv_create("forkbench");
+		if (lk == NULL || cv == NULL) {
+			if (lk != NULL) {
+				lock_destroy(lk);
+			}
+			if (cv != NULL) {
+				cv_destroy(cv);
+			}
+			return ENOMEM;
+		}
+		cv_destroy(cv);
+		lock_destroy(lk);
+	}
+	*synchus = bench_stop(secs, nsecs);
+	return 0;
+}
+
+int
+forkbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	uint32_t offfork, offsynch, onfork, onsynch;
+	bool old;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("forkbench", 0);
+	if (sem == NULL) {
+		return ENOMEM;
+	}
+
+	old = kmem_cache_setenabled(false);
+	result = fork_rounds(sem, &offfork, &offsynch);
+	kmem_cache_setenabled(true);
+	if (result == 0) {
+		result = fork_rounds(sem, &onfork, &onsynch);
+	}
+	kmem_cache_setenabled(old);
+	sem_destroy(sem);
+	if (result) {
+		kprintf("forkbench: %s\n", strerror(result));
+		return result;
+	}
+
+	kprintf("Fork/exit, %u rounds each way:\n", FORK_ROUNDS);
+	kprintf("                     caches off    caches on\n");
+	kprintf("  thread fork/exit:  %6u us     %6u us\n",
+		offfork / FORK_ROUNDS, onfork / FORK_ROUNDS);
+	kprintf("  lock+cv create:    %6u ns     %6u ns\n",
+		bench_per_op(offsynch, FORK_ROUNDS),
+		bench_per_op(onsynch, FORK_ROUNDS));
+	kmem_cache_printstats();
+	kprintf("forkbench done.\n");
+	return 0;
+}
@@ -39,6 +39,30 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <kern/errno.h>
+#include <kmem_cache.h>
+
+/*
+ * Locks and CVs are cached with their wait channels (and, for locks,
+ * the spinlock) still set up; only the name is new each time, and
+ * that is normally copied into the object rather than kstrdup'd.
+ */
+static int lock_ctor(void *obj);
+static void lock_dtor(void *obj);
+static int cv_ctor(void *obj);
+static void cv_dtor(void *obj);
+static char *synch_setname(char *buf, const char *name);
+static void synch_freename(char *buf, char *name);
+
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock),
+			       lock_ctor, lock_dtor, KMEM_CACHE_MAXFREE);
+static struct kmem_cache cv_cache =
+	KMEM_CACHE_INITIALIZER("cv", sizeof(struct cv),
+			       cv_ctor, cv_dtor, KMEM_CACHE_MAXFREE);
+#endif
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,6 +171,91 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+#if OPT_A3
+/*
+ * Copy NAME into BUF if it fits, else kstrdup it. Returns NULL only
+ * if kstrdup fails.
+ */
+static
+char *
+synch_setname(char *buf, const char *name)
+{
+        if (strlen(name) < SYNCH_NAMELEN) {
+                strcpy(buf, name);
+                return buf;
+        }
+        return kstrdup(name);
+}
+
+static
+void
+synch_freename(char *buf, char *name)
+{
+        if (name != buf) {
+                kfree(name);
+        }
+}
+
+static
+int
+lock_ctor(void *obj)
+{
+        struct lock *lock = obj;
+
+        lock->lk_wchan = wchan_create("lock");
+        if (lock->lk_wchan == NULL) {
+                return ENOMEM;
+        }
+        spinlock_init(&lock->lk_lock);
+        lock->lk_thread = NULL;
+        return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+        struct lock *lock = obj;
+
+        spinlock_cleanup(&lock->lk_lock);
+        wchan_destroy(lock->lk_wchan);
+}
+
+struct lock *
+lock_create(const char *name)
+{
+        struct lock *lock;
+
+        lock = kmem_cache_alloc(&lock_cache);
+        if (lock == NULL) {
+                return NULL;
+        }
+
+        lock->lk_name = synch_setname(lock->lk_namebuf, name);
+        if (lock->lk_name == NULL) {
+                kmem_cache_free(&lock_cache, lock);
+                return NULL;
+        }
+        wchan_setname(lock->lk_wchan, lock->lk_name);
+
+        return lock;
+}
+
+void
+lock_destroy(struct lock *lock)
+{
+        KASSERT(lock != NULL);
+        /* it goes back to the cache as is, so it must be idle */
+        KASSERT(lock->lk_thread == NULL);
+        KASSERT(!spinlock_do_i_hold(&lock->lk_lock));
+        KASSERT(wchan_isempty(lock->lk_wchan));
+
+        /* the name is about to go; don't leave the wchan pointing at it */
+        wchan_setname(lock->lk_wchan, "lock");
+        synch_freename(lock->lk_namebuf, lock->lk_name);
+        kmem_cache_free(&lock_cache, lock);
+}
+#else
 struct lock *
 lock_create(const char *name)
 {
@@ -188,6 +297,7 @@ lock_destroy(struct lock *lock)
         kfree(lock->lk_name);
         kfree(lock);
 }
+#endif
 
 void
 lock_acquire(struct lock *lock)
@@ -238,6 +348,60 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+#if OPT_A3
+static
+int
+cv_ctor(void *obj)
+{
+        struct cv *cv = obj;
+
+        cv->cv_wchan = wchan_create("cv");
+        if (cv->cv_wchan == NULL) {
+                return ENOMEM;
+        }
+        return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+        struct cv *cv = obj;
+
+        wchan_destroy(cv->cv_wchan);
+}
+
+struct cv *
+cv_create(const char *name)
+{
+        struct cv *cv;
+
+        cv = kmem_cache_alloc(&cv_cache);
+        if (cv == NULL) {
+                return NULL;
+        }
+
+        cv->cv_name = synch_setname(cv->cv_namebuf, name);
+        if (cv->cv_name==NULL) {
+                kmem_cache_free(&cv_cache, cv);
+                return NULL;
+        }
+        wchan_setname(cv->cv_wchan, cv->cv_name);
+
+        return cv;
+}
+
+void
+cv_destroy(struct cv *cv)
+{
+        KASSERT(cv != NULL);
+        KASSERT(wchan_isempty(cv->cv_wchan));
+
+        wchan_setname(cv->cv_wchan, "cv");
+        synch_freename(cv->cv_namebuf, cv->cv_name);
+        kmem_cache_free(&cv_cache, cv);
+}
+#else
 struct cv *
 cv_create(const char *name)
 {
@@ -274,6 +438,7 @@ cv_destroy(struct cv *cv)
         kfree(cv->cv_name);
         kfree(cv);
 }
+#endif
 
 void
 cv_wait(struct cv *cv, struct lock *lock)
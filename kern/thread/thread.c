@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
+#include <platform/maxcpus.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
@@ -52,6 +53,10 @@
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
+#if OPT_A3
+#include <kmem_cache.h>
+#endif
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -64,6 +69,29 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+#if OPT_A3
+/*
+ * Caches for threads, their stacks, and wait channels. A cached
+ * thread has its list node and machine-dependent part set up; a
+ * cached wait channel has its lock and (empty) thread list. Stacks
+ * are just memory, but they're a whole page each, so only a few are
+ * kept.
+ */
+static int thread_ctor(void *obj);
+static void thread_dtor(void *obj);
+static int wchan_ctor(void *obj);
+static void wchan_dtor(void *obj);
+
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread),
+			       thread_ctor, thread_dtor, KMEM_CACHE_MAXFREE);
+static struct kmem_cache stack_cache =
+	KMEM_CACHE_INITIALIZER("stack", STACK_SIZE, NULL, NULL, 4);
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan),
+			       wchan_ctor, wchan_dtor, KMEM_CACHE_MAXFREE);
+#endif
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -111,6 +139,32 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+#if OPT_A3
+/*
+ * Constructor and destructor for thread_cache.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+}
+#endif
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,22 +177,33 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
+#if OPT_A3
+	thread = kmem_cache_alloc(&thread_cache);
+#else
 	thread = kmalloc(sizeof(*thread));
+#endif
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
+#if OPT_A3
+		kmem_cache_free(&thread_cache, thread);
+#else
 		kfree(thread);
+#endif
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
+#if !OPT_A3
+	/* (the cache's constructor did these) */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
+#endif
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
@@ -149,6 +214,10 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+#if OPT_A3
+	thread->t_usersp = 0;
+#endif
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -187,6 +256,7 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdowns = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -214,7 +284,11 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
+#if OPT_A3
+		c->c_curthread->t_stack = kmem_cache_alloc(&stack_cache);
+#else
 		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+#endif
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -249,17 +323,31 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
+#if OPT_A3
+	if (thread->t_stack != NULL) {
+		kmem_cache_free(&stack_cache, thread->t_stack);
+	}
+	/* the rest goes back to the cache as it is, if it's clean */
+	KASSERT(thread->t_listnode.tln_next == NULL);
+	KASSERT(thread->t_listnode.tln_prev == NULL);
+	KASSERT(thread->t_machdep.tm_badfaultfunc == NULL);
+#else
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
+#endif
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
+#if OPT_A3
+	kmem_cache_free(&thread_cache, thread);
+#else
 	kfree(thread);
+#endif
 }
 
 /*
@@ -493,7 +581,11 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
+#if OPT_A3
+	newthread->t_stack = kmem_cache_alloc(&stack_cache);
+#else
 	newthread->t_stack = kmalloc(STACK_SIZE);
+#endif
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -971,17 +1063,47 @@ thread_consider_migration(void)
  * arrangements should be made to free it after the wait channel is
  * destroyed.
  */
+#if OPT_A3
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+#endif
+
 struct wchan *
 wchan_create(const char *name)
 {
 	struct wchan *wc;
 
+#if OPT_A3
+	wc = kmem_cache_alloc(&wchan_cache);
+	if (wc == NULL) {
+		return NULL;
+	}
+#else
 	wc = kmalloc(sizeof(*wc));
 	if (wc == NULL) {
 		return NULL;
 	}
 	spinlock_init(&wc->wc_lock);
 	threadlist_init(&wc->wc_threads);
+#endif
 	wc->wc_name = name;
 	return wc;
 }
@@ -993,11 +1115,30 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
+#if OPT_A3
+	/* back to the cache still set up; check what cleanup would */
+	KASSERT(!spinlock_do_i_hold(&wc->wc_lock));
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	kmem_cache_free(&wchan_cache, wc);
+#else
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
 	kfree(wc);
+#endif
 }
 
+#if OPT_A3
+/*
+ * Rename a wait channel. For objects that keep a wait channel across
+ * reuse (see synch.c), whose names change each time.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+#endif
+
 /*
  * Lock and unlock a wait channel, respectively.
  */
@@ -1162,6 +1303,62 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send the N mappings in MAPPINGS to each CPU in CPUMASK (a bit per
+ * c_number), with one IPI per CPU, and wait until every one of them
+ * has dealt with them. A CPU that would end up with more than
+ * TLBSHOOTDOWN_MAX queued flushes everything instead.
+ *
+ * Interrupts must be on, since the targets may be waiting on us in
+ * the same way.
+ */
+void
+ipi_tlbshootdown_wait(uint32_t cpumask, const struct tlbshootdown *mappings,
+		      unsigned n)
+{
+	unsigned tickets[MAXCPUS];
+	struct cpu *c;
+	unsigned i, j;
+	int num;
+
+	KASSERT(curthread->t_curspl == 0);
+	KASSERT((cpumask & ((uint32_t)1 << curcpu->c_number)) == 0);
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		if ((cpumask & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+
+		spinlock_acquire(&c->c_ipi_lock);
+		num = c->c_numshootdown;
+		if (num != TLBSHOOTDOWN_ALL &&
+		    num + n <= TLBSHOOTDOWN_MAX) {
+			for (j=0; j<n; j++) {
+				c->c_shootdown[num + j] = mappings[j];
+			}
+			c->c_numshootdown = num + n;
+		}
+		else {
+			c->c_numshootdown = TLBSHOOTDOWN_ALL;
+		}
+		tickets[i] = c->c_shootdowns;
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+	}
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		if ((cpumask & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		while (c->c_shootdowns == tickets[i]) {
+			/* spin */
+		}
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -1202,6 +1399,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdowns++;
 	}
 
 	curcpu->c_ipi_pending = 0;
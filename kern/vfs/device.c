@@ -42,6 +42,7 @@
 #include <synch.h>
 #include <vnode.h>
 #include <device.h>
+#include "opt-A3.h"
 
 /*
  * Called for each open().
@@ -240,6 +241,18 @@ null_fsync(struct vnode *v)
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * For mmap. None of our devices make sense to map.
+ */
+static
+int
+dev_mmap(struct vnode *v)
+{
+	(void)v;
+	return ENODEV;
+}
+#else
 /*
  * For mmap. If you want this to do anything, you have to write it
  * yourself. Some devices may not make sense to map. Others do.
@@ -251,6 +264,7 @@ dev_mmap(struct vnode *v  /* add stuff as needed */)
 	(void)v;
 	return EUNIMP;
 }
+#endif
 
 /*
  * For ftruncate(). 
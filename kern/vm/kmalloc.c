@@ -30,7 +30,16 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <clock.h>
 #include <vm.h>
+#include "opt-A3.h"
+#if OPT_A3
+#include <kmem_cache.h>
+#endif
 
 /*
  * Kernel malloc.
@@ -138,6 +147,66 @@ struct pageref {
 #define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
 static struct pageref pagerefs[NPAGEREFS];
 
+#if OPT_A3
+/*
+ * ...except that sys161 can be given far more than 1M, and then the
+ * heap ran out of pagerefs long before memory. So the page in the BSS
+ * is now only the first: when it runs out, more pages of pagerefs
+ * come straight from alloc_kpages (never from the subpage allocator,
+ * which would need a pageref to hand one out; see growpagerefs).
+ * Free pagerefs are kept on a list through next_samesize. Pages of
+ * pagerefs are never given back; each costs 1/256 of the heap pages
+ * it can describe.
+ */
+static struct pageref *freepagerefs;
+static bool pagerefs_started;
+static unsigned npagerefpages = 1;	/* including the one in the BSS */
+static unsigned npagerefs_inuse;
+
+static
+void
+addpagerefs(struct pageref *prs)
+{
+	unsigned i;
+
+	for (i=0; i<NPAGEREFS; i++) {
+		prs[i].next_samesize = freepagerefs;
+		freepagerefs = &prs[i];
+	}
+}
+
+static
+struct pageref *
+allocpageref(void)
+{
+	struct pageref *pr;
+
+	if (!pagerefs_started) {
+		addpagerefs(pagerefs);
+		pagerefs_started = true;
+	}
+
+	pr = freepagerefs;
+	if (pr == NULL) {
+		/* ran out */
+		return NULL;
+	}
+	freepagerefs = pr->next_samesize;
+	npagerefs_inuse++;
+	return pr;
+}
+
+static
+void
+freepageref(struct pageref *p)
+{
+	KASSERT(npagerefs_inuse > 0);
+
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
+	npagerefs_inuse--;
+}
+#else
 #define INUSE_WORDS (NPAGEREFS/32)
 static uint32_t pagerefs_inuse[INUSE_WORDS];
 
@@ -181,6 +250,8 @@ freepageref(struct pageref *p)
 	pagerefs_inuse[i] &= ~k;
 }
 
+#endif
+
 ////////////////////////////////////////
 
 static struct pageref *sizebases[NSIZES];
@@ -188,15 +259,74 @@ static struct pageref *allbase;
 
 ////////////////////////////////////////
 
+#if OPT_A3
+/*
+ * One spinlock covers the subpage allocator's own structures. Small
+ * allocations and frees mostly go through per-CPU magazines of
+ * blocks instead (see below), which only take it to refill or empty
+ * a magazine.
+ */
+#else
 /*
  * Use one spinlock for the whole thing. Making parts of the kmalloc
  * logic per-cpu is worthwhile for scalability; however, for the time
  * being at least we won't, because it adds a lot of complexity and in
  * OS/161 performance and scalability aren't super-critical.
  */
+#endif
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+#if OPT_A3
+/*
+ * Count how often the lock is still taken, and how often another CPU
+ * had it at the time.
+ */
+static unsigned km_acquires;
+static unsigned km_contended;
+
+static
+void
+kmalloc_lock(void)
+{
+	bool busy;
+
+	/* an unlocked peek, only for the statistics */
+	busy = spinlock_data_get(&kmalloc_spinlock.lk_lock) != 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	km_acquires++;
+	if (busy) {
+		km_contended++;
+	}
+}
+#else
+#define kmalloc_lock() spinlock_acquire(&kmalloc_spinlock)
+#endif
+
+#if OPT_A3
+/*
+ * Add a page of pagerefs. Called without kmalloc_spinlock, since
+ * alloc_kpages may have to page something out to find the page.
+ */
+static
+bool
+growpagerefs(void)
+{
+	vaddr_t page;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return false;
+	}
+
+	kmalloc_lock();
+	addpagerefs((struct pageref *)page);
+	npagerefpages++;
+	spinlock_release(&kmalloc_spinlock);
+	return true;
+}
+#endif
+
 ////////////////////////////////////////
 
 /* SLOWER implies SLOW */
@@ -247,6 +377,12 @@ checksubpage(struct pageref *pr)
 #endif
 
 #ifdef SLOWER
+#if OPT_A3
+#define MAXPAGEREFS (NPAGEREFS * npagerefpages)
+#else
+#define MAXPAGEREFS NPAGEREFS
+#endif
+
 static
 void
 checksubpages(void)
@@ -260,14 +396,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < MAXPAGEREFS);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < MAXPAGEREFS);
 		ac++;
 	}
 
@@ -330,11 +466,22 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+#if OPT_A3
+static void kmag_printstats(void);
+#endif
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
 
+#if OPT_A3
+	kmag_printstats();
+	kprintf("pagerefs: %u in use, %u pages of them\n",
+		npagerefs_inuse, npagerefpages);
+	kmem_cache_printstats();
+#endif
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -392,6 +539,39 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Find the pageref of the page PTR is on, or NULL if it isn't one of
+ * ours. The coremap remembers it for every page it manages (see
+ * kpage_setref), so only pages we got before vm_bootstrap have to be
+ * searched for. PTR must be a live block (or a whole-page allocation),
+ * so that its page can't go away meanwhile. Caller must not hold
+ * kmalloc_spinlock.
+ */
+static
+struct pageref *
+findpageref(void *ptr)
+{
+	struct pageref *pr;
+	vaddr_t ptraddr = (vaddr_t)ptr;
+	void *ref;
+
+	if (kpage_getref(ptraddr & PAGE_FRAME, &ref)) {
+		return ref;
+	}
+
+	kmalloc_lock();
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		if (ptraddr >= PR_PAGEADDR(pr) &&
+		    ptraddr < PR_PAGEADDR(pr) + PAGE_SIZE) {
+			break;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return pr;
+}
+#endif
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -409,7 +589,7 @@ subpage_kmalloc(size_t sz)
 	blktype = blocktype(sz);
 	sz = sizes[blktype];
 
-	spinlock_acquire(&kmalloc_spinlock);
+	kmalloc_lock();
 
 	checksubpages();
 
@@ -466,9 +646,23 @@ subpage_kmalloc(size_t sz)
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
 		return NULL;
 	}
-	spinlock_acquire(&kmalloc_spinlock);
+	kmalloc_lock();
 
 	pr = allocpageref();
+#if OPT_A3
+	while (pr==NULL) {
+		/* get another page of them, without the lock */
+		spinlock_release(&kmalloc_spinlock);
+		if (!growpagerefs()) {
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"pageref\n");
+			return NULL;
+		}
+		kmalloc_lock();
+		pr = allocpageref();
+	}
+#endif
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
@@ -479,6 +673,9 @@ subpage_kmalloc(size_t sz)
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+#if OPT_A3
+	kpage_setref(prpage, pr);
+#endif
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -522,7 +719,22 @@ subpage_kfree(void *ptr)
 
 	ptraddr = (vaddr_t)ptr;
 
-	spinlock_acquire(&kmalloc_spinlock);
+#if OPT_A3
+	pr = findpageref(ptr);
+	if (pr==NULL) {
+		/* Not on any of our pages - not a subpage allocation */
+		return -1;
+	}
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	kmalloc_lock();
+
+	checksubpages();
+	checksubpage(pr);
+#else
+	kmalloc_lock();
 
 	checksubpages();
 
@@ -544,6 +756,7 @@ subpage_kfree(void *ptr)
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
+#endif
 
 	offset = ptraddr - prpage;
 
@@ -578,6 +791,9 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+#if OPT_A3
+		kpage_setref(prpage, NULL);
+#endif
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -595,12 +811,696 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+#if OPT_A3
+////////////////////////////////////////////////////////////
+//
+// Per-CPU magazines.
+//
+// In front of the subpage allocator, each CPU keeps two magazines
+// (small stacks of free blocks) for each size class, and allocates
+// from and frees to them without taking kmalloc_spinlock. When both
+// are empty on allocation, or both full on free, it trades one with
+// the depot: a list per size class of full magazines and one of empty
+// ones, kept under kmalloc_spinlock. Keeping two magazines means a
+// CPU that goes back and forth across a magazine boundary doesn't go
+// to the depot every time. This is Bonwick's magazine layer, minus
+// the dynamic resizing.
+//
+// Magazines are blocks of the subpage allocator themselves. They
+// are only made on the allocation path, so that kfree never has to
+// allocate. The depot keeps at most KDEPOT_MAXFULL full magazines
+// per size class; past that, a CPU with two full magazines gives the
+// blocks in one of them back to their pages. A magazine of big blocks
+// holds fewer of them, so that no magazine sits on more than 2k.
+//
+// Magazines are only touched by their own CPU, with interrupts off
+// so the thread can't be switched or migrated under us.
+//
+
+#define KMAG_SIZE       14	/* so that a magazine is 64 bytes */
+#define KMAG_MAXBYTES   2048
+#define KDEPOT_MAXFULL  4
+
+struct kmag {
+	struct kmag *km_next;	/* on a depot list */
+	unsigned km_rounds;	/* blocks in km_objs */
+	void *km_objs[KMAG_SIZE];
+};
+
+struct kmcpu {
+	struct kmag *kc_loaded;	/* used first */
+	struct kmag *kc_prev;	/* full or empty */
+
+	/* statistics */
+	unsigned kc_allocs;	/* allocations */
+	unsigned kc_allochits;	/* ...from a magazine */
+	unsigned kc_frees;	/* frees */
+	unsigned kc_freehits;	/* ...to a magazine */
+	unsigned kc_flushes;	/* full magazines given back */
+};
+
+struct kdepot {
+	struct kmag *kd_full;
+	struct kmag *kd_empty;
+	unsigned kd_nfull;
+	unsigned kd_nempty;
+
+	/* statistics */
+	unsigned kd_exchanges;	/* magazines traded */
+};
+
+static struct kmcpu kmcpus[MAXCPUS][NSIZES];
+static struct kdepot kdepots[NSIZES];
+static bool kmag_enabled = true;
+
+static
+unsigned
+kmag_cap(unsigned blktype)
+{
+	unsigned cap = KMAG_MAXBYTES / sizes[blktype];
+
+	return cap < KMAG_SIZE ? cap : KMAG_SIZE;
+}
+
+static
+void
+kmag_swap(struct kmcpu *kc)
+{
+	struct kmag *mag;
+
+	mag = kc->kc_loaded;
+	kc->kc_loaded = kc->kc_prev;
+	kc->kc_prev = mag;
+}
+
+/*
+ * Make a new empty magazine for size class BLKTYPE, and give it to
+ * the current CPU if it has fewer than two, or else to the depot.
+ */
+static
+void
+kmag_grow(unsigned blktype)
+{
+	struct kmcpu *kc;
+	struct kdepot *kd = &kdepots[blktype];
+	struct kmag *mag;
+	int spl;
+
+	mag = subpage_kmalloc(sizeof(struct kmag));
+	if (mag == NULL) {
+		return;
+	}
+	mag->km_next = NULL;
+	mag->km_rounds = 0;
+
+	spl = splhigh();
+	kc = &kmcpus[curcpu->c_number][blktype];
+	if (kc->kc_loaded == NULL) {
+		kc->kc_loaded = mag;
+	}
+	else if (kc->kc_prev == NULL) {
+		kc->kc_prev = mag;
+	}
+	else {
+		kmalloc_lock();
+		mag->km_next = kd->kd_empty;
+		kd->kd_empty = mag;
+		kd->kd_nempty++;
+		spinlock_release(&kmalloc_spinlock);
+	}
+	splx(spl);
+}
+
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct kmcpu *kc;
+	struct kdepot *kd = &kdepots[blktype];
+	struct kmag *mag;
+	void *ptr;
+	bool grow;
+	int spl;
+
+	spl = splhigh();
+	kc = &kmcpus[curcpu->c_number][blktype];
+	kc->kc_allocs++;
+
+	if (kc->kc_loaded != NULL && kc->kc_loaded->km_rounds == 0 &&
+	    kc->kc_prev != NULL && kc->kc_prev->km_rounds > 0) {
+		kmag_swap(kc);
+	}
+	if (kc->kc_loaded != NULL && kc->kc_loaded->km_rounds > 0) {
+		mag = kc->kc_loaded;
+		ptr = mag->km_objs[--mag->km_rounds];
+		kc->kc_allochits++;
+		splx(spl);
+		return ptr;
+	}
+
+	/* both empty (or missing): trade one in for a full one */
+	ptr = NULL;
+	kmalloc_lock();
+	mag = kd->kd_full;
+	if (mag != NULL) {
+		kd->kd_full = mag->km_next;
+		kd->kd_nfull--;
+		if (kc->kc_prev != NULL) {
+			KASSERT(kc->kc_prev->km_rounds == 0);
+			kc->kc_prev->km_next = kd->kd_empty;
+			kd->kd_empty = kc->kc_prev;
+			kd->kd_nempty++;
+		}
+		kc->kc_prev = kc->kc_loaded;
+		kc->kc_loaded = mag;
+		kd->kd_exchanges++;
+		ptr = mag->km_objs[--mag->km_rounds];
+	}
+	grow = kc->kc_prev == NULL || kd->kd_empty == NULL;
+	spinlock_release(&kmalloc_spinlock);
+	splx(spl);
+
+	if (ptr != NULL) {
+		return ptr;
+	}
+
+	/* nothing cached anywhere; go to the pages */
+	ptr = subpage_kmalloc(sizes[blktype]);
+	if (ptr != NULL && grow) {
+		kmag_grow(blktype);
+	}
+	return ptr;
+}
+
+static
+void
+kmag_free(void *ptr, unsigned blktype)
+{
+	struct kmcpu *kc;
+	struct kdepot *kd = &kdepots[blktype];
+	struct kmag *mag;
+	unsigned cap = kmag_cap(blktype);
+	int spl;
+
+	/* same as subpage_kfree would do */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	spl = splhigh();
+	kc = &kmcpus[curcpu->c_number][blktype];
+	kc->kc_frees++;
+
+	if (kc->kc_loaded != NULL && kc->kc_loaded->km_rounds == cap &&
+	    kc->kc_prev != NULL && kc->kc_prev->km_rounds == 0) {
+		kmag_swap(kc);
+	}
+	if (kc->kc_loaded == NULL) {
+		/* no magazines yet */
+		splx(spl);
+		subpage_kfree(ptr);
+		return;
+	}
+	if (kc->kc_loaded->km_rounds < cap) {
+		mag = kc->kc_loaded;
+		mag->km_objs[mag->km_rounds++] = ptr;
+		kc->kc_freehits++;
+		splx(spl);
+		return;
+	}
+
+	/* both full (or just one, and full): trade one in for an empty one */
+	kmalloc_lock();
+	mag = kd->kd_empty;
+	if (mag != NULL && kd->kd_nfull < KDEPOT_MAXFULL) {
+		kd->kd_empty = mag->km_next;
+		kd->kd_nempty--;
+		if (kc->kc_prev != NULL) {
+			KASSERT(kc->kc_prev->km_rounds == cap);
+			kc->kc_prev->km_next = kd->kd_full;
+			kd->kd_full = kc->kc_prev;
+			kd->kd_nfull++;
+		}
+		kc->kc_prev = kc->kc_loaded;
+		kc->kc_loaded = mag;
+		kd->kd_exchanges++;
+		spinlock_release(&kmalloc_spinlock);
+	}
+	else {
+		/* the depot has enough; give these blocks back instead */
+		spinlock_release(&kmalloc_spinlock);
+		mag = kc->kc_loaded;
+		while (mag->km_rounds > 0) {
+			subpage_kfree(mag->km_objs[--mag->km_rounds]);
+		}
+		kc->kc_flushes++;
+	}
+
+	mag = kc->kc_loaded;
+	mag->km_objs[mag->km_rounds++] = ptr;
+	splx(spl);
+}
+
+/*
+ * Give every block in MAG back to the subpage allocator, then MAG
+ * itself.
+ */
+static
+void
+kmag_empty(struct kmag *mag)
+{
+	while (mag->km_rounds > 0) {
+		subpage_kfree(mag->km_objs[--mag->km_rounds]);
+	}
+	subpage_kfree(mag);
+}
+
+/*
+ * Empty the depot and this CPU's magazines, so the pages their blocks
+ * are on can be freed. Other CPUs' magazines can only be touched by
+ * their own CPU, and are left alone. For when memory runs out; the
+ * magazines come back as they're needed.
+ */
+void
+kmag_reap(void)
+{
+	struct kmcpu *kc;
+	struct kdepot *kd;
+	struct kmag *full, *empty, *loaded, *prev, *mag;
+	unsigned i;
+	int spl;
+
+	for (i = 0; i < NSIZES; i++) {
+		kd = &kdepots[i];
+		kmalloc_lock();
+		full = kd->kd_full;
+		empty = kd->kd_empty;
+		kd->kd_full = kd->kd_empty = NULL;
+		kd->kd_nfull = kd->kd_nempty = 0;
+		spinlock_release(&kmalloc_spinlock);
+
+		loaded = prev = NULL;
+		if (CURCPU_EXISTS()) {
+			spl = splhigh();
+			kc = &kmcpus[curcpu->c_number][i];
+			loaded = kc->kc_loaded;
+			prev = kc->kc_prev;
+			kc->kc_loaded = kc->kc_prev = NULL;
+			splx(spl);
+		}
+
+		while ((mag = full) != NULL) {
+			full = mag->km_next;
+			kmag_empty(mag);
+		}
+		while ((mag = empty) != NULL) {
+			empty = mag->km_next;
+			kmag_empty(mag);
+		}
+		if (loaded != NULL) {
+			kmag_empty(loaded);
+		}
+		if (prev != NULL) {
+			kmag_empty(prev);
+		}
+	}
+}
+
+/*
+ * Turn the magazines on or off (for comparing). Blocks already in
+ * magazines stay there until they are turned back on.
+ */
+void
+kmalloc_setmagazines(bool on)
+{
+	kmag_enabled = on;
+}
+
+static
+void
+kmag_printstats(void)
+{
+	struct kmcpu *kc;
+	struct kdepot *kd;
+	unsigned i, j;
+
+	/* unlocked; only a snapshot */
+	kprintf("kmalloc lock: %u acquisitions, %u contended; "
+		"magazines %s\n", km_acquires, km_contended,
+		kmag_enabled ? "on" : "off");
+	kprintf("size cpu   allocs   hit%%    frees   hit%%  flushes\n");
+	for (i = 0; i < NSIZES; i++) {
+		for (j = 0; j < MAXCPUS; j++) {
+			kc = &kmcpus[j][i];
+			if (kc->kc_allocs == 0 && kc->kc_frees == 0) {
+				continue;
+			}
+			kprintf("%4u %3u %8u %5u%% %8u %5u%% %8u\n",
+				sizes[i], j, kc->kc_allocs,
+				kc->kc_allocs ?
+				kc->kc_allochits * 100 / kc->kc_allocs : 0,
+				kc->kc_frees,
+				kc->kc_frees ?
+				kc->kc_freehits * 100 / kc->kc_frees : 0,
+				kc->kc_flushes);
+		}
+	}
+	kprintf("size  full empty exchanges\n");
+	for (i = 0; i < NSIZES; i++) {
+		kd = &kdepots[i];
+		if (kd->kd_nfull == 0 && kd->kd_nempty == 0 &&
+		    kd->kd_exchanges == 0) {
+			continue;
+		}
+		kprintf("%4u %5u %5u %9u\n", sizes[i], kd->kd_nfull,
+			kd->kd_nempty, kd->kd_exchanges);
+	}
+}
+#endif /* OPT_A3 */
+
+#if OPT_A3
+////////////////////////////////////////
+//
+// Allocation profiler.
+//
+// Off unless turned on (kmalloc_setprofile). While on, every kmalloc
+// is charged to its caller -- the return address, so a call through
+// kstrdup or kmem_cache_alloc is charged to those -- and to its size
+// class, and every block is remembered with its caller and when it
+// was allocated, so that kfree can charge its lifetime. Blocks
+// allocated while the profiler was off, or after the table of live
+// blocks filled up, aren't seen when they're freed.
+//
+// Everything lives in fixed tables, so the profiler never calls
+// kmalloc. Lifetimes are kept to the microsecond in 32 bits, so any
+// over 71 minutes come out wrong.
+//
+
+#define KPROF_NSITES   128	/* call sites; a power of 2 */
+#define KPROF_NLIVE    1024	/* live blocks; a power of 2 */
+#define KPROF_NHIST    8	/* lifetime buckets: <10us, <100us, ... */
+#define KPROF_NPRINT   20	/* call sites printed */
+#define KPROF_BIG      NSIZES	/* size class for whole pages */
+
+struct kprof_stats {
+	unsigned kp_allocs;
+	unsigned kp_bytes;	/* asked for */
+	unsigned kp_frees;	/* of blocks seen allocated */
+	unsigned kp_live;	/* ...and not yet freed */
+	unsigned kp_hist[KPROF_NHIST];
+};
+
+struct kprof_site {
+	vaddr_t ks_caller;	/* 0: slot unused */
+	struct kprof_stats ks_stats;
+};
+
+struct kprof_live {
+	void *kl_ptr;		/* NULL: slot unused */
+	uint32_t kl_when;	/* microseconds, mod 2^32 */
+	uint16_t kl_site;
+	uint8_t kl_class;
+};
+
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+static volatile bool kprof_enabled;
+static struct kprof_site kprof_sites[KPROF_NSITES];
+static struct kprof_stats kprof_othersite;	/* when kprof_sites fills */
+static struct kprof_stats kprof_classes[NSIZES + 1];
+static struct kprof_live kprof_live[KPROF_NLIVE];
+static unsigned kprof_nlive;
+static unsigned kprof_untracked;	/* allocs kprof_live had no room for */
+
+static
+uint32_t
+kprof_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint32_t)secs * 1000000 + nsecs / 1000;
+}
+
+static
+unsigned
+kprof_livehash(void *ptr)
+{
+	return ((uint32_t)ptr >> 4) * 2654435761U % KPROF_NLIVE;
+}
+
+/*
+ * Find (or add) the slot for call site CALLER. Returns KPROF_NSITES
+ * when the table is full.
+ */
+static
+unsigned
+kprof_site(vaddr_t caller)
+{
+	unsigned i, n;
+
+	i = (caller >> 2) * 2654435761U % KPROF_NSITES;
+	for (n = 0; n < KPROF_NSITES; n++) {
+		if (kprof_sites[i].ks_caller == caller) {
+			return i;
+		}
+		if (kprof_sites[i].ks_caller == 0) {
+			kprof_sites[i].ks_caller = caller;
+			return i;
+		}
+		i = (i + 1) % KPROF_NSITES;
+	}
+	return KPROF_NSITES;
+}
+
+static
+struct kprof_stats *
+kprof_sitestats(unsigned site)
+{
+	if (site == KPROF_NSITES) {
+		return &kprof_othersite;
+	}
+	return &kprof_sites[site].ks_stats;
+}
+
+/*
+ * Take slot I out of kprof_live, moving later entries of the same
+ * probe sequence back so that lookups don't stop short at the hole.
+ */
+static
+void
+kprof_liveremove(unsigned i)
+{
+	unsigned j, k;
+
+	j = i;
+	while (1) {
+		kprof_live[i].kl_ptr = NULL;
+		while (1) {
+			j = (j + 1) % KPROF_NLIVE;
+			if (kprof_live[j].kl_ptr == NULL) {
+				return;
+			}
+			k = kprof_livehash(kprof_live[j].kl_ptr);
+			/* can j's entry stay where it is? */
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+				continue;
+			}
+			break;
+		}
+		kprof_live[i] = kprof_live[j];
+		i = j;
+	}
+}
+
+static
+void
+kprof_alloc(void *ptr, size_t sz, vaddr_t caller)
+{
+	struct kprof_stats *ks, *kc;
+	unsigned site, class, i;
+	uint32_t now;
+
+	now = kprof_now();
+	class = sz < LARGEST_SUBPAGE_SIZE ? (unsigned)blocktype(sz) : KPROF_BIG;
+
+	spinlock_acquire(&kprof_lock);
+	if (!kprof_enabled) {
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	site = kprof_site(caller);
+	ks = kprof_sitestats(site);
+	kc = &kprof_classes[class];
+	ks->kp_allocs++;
+	ks->kp_bytes += sz;
+	kc->kp_allocs++;
+	kc->kp_bytes += sz;
+
+	/* keep one slot empty, so lookups always stop */
+	if (kprof_nlive == KPROF_NLIVE - 1) {
+		kprof_untracked++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	i = kprof_livehash(ptr);
+	while (kprof_live[i].kl_ptr != NULL) {
+		i = (i + 1) % KPROF_NLIVE;
+	}
+	kprof_live[i].kl_ptr = ptr;
+	kprof_live[i].kl_when = now;
+	kprof_live[i].kl_site = site;
+	kprof_live[i].kl_class = class;
+	kprof_nlive++;
+	ks->kp_live++;
+	kc->kp_live++;
+	spinlock_release(&kprof_lock);
+}
+
+static
+void
+kprof_free(void *ptr)
+{
+	struct kprof_stats *ks, *kc;
+	uint32_t life;
+	unsigned i, b;
+
+	life = kprof_now();
+
+	spinlock_acquire(&kprof_lock);
+	i = kprof_livehash(ptr);
+	while (kprof_live[i].kl_ptr != NULL && kprof_live[i].kl_ptr != ptr) {
+		i = (i + 1) % KPROF_NLIVE;
+	}
+	if (kprof_live[i].kl_ptr == NULL) {
+		/* not seen allocated */
+		spinlock_release(&kprof_lock);
+		return;
+	}
+
+	life -= kprof_live[i].kl_when;
+	for (b = 0; b < KPROF_NHIST - 1 && life >= 10; b++) {
+		life /= 10;
+	}
+	ks = kprof_sitestats(kprof_live[i].kl_site);
+	kc = &kprof_classes[kprof_live[i].kl_class];
+	ks->kp_frees++;
+	ks->kp_live--;
+	ks->kp_hist[b]++;
+	kc->kp_frees++;
+	kc->kp_live--;
+	kc->kp_hist[b]++;
+	kprof_liveremove(i);
+	kprof_nlive--;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Turn the profiler on (starting from nothing) or off (keeping what
+ * it has, for kmalloc_printprofile).
+ */
+void
+kmalloc_setprofile(bool on)
+{
+	spinlock_acquire(&kprof_lock);
+	if (on && !kprof_enabled) {
+		bzero(kprof_sites, sizeof(kprof_sites));
+		bzero(&kprof_othersite, sizeof(kprof_othersite));
+		bzero(kprof_classes, sizeof(kprof_classes));
+		bzero(kprof_live, sizeof(kprof_live));
+		kprof_nlive = 0;
+		kprof_untracked = 0;
+	}
+	kprof_enabled = on;
+	spinlock_release(&kprof_lock);
+}
+
+static
+void
+kprof_printstats(const struct kprof_stats *kp)
+{
+	unsigned b;
+
+	kprintf("%8u %9u %7u %6u ", kp->kp_allocs, kp->kp_bytes,
+		kp->kp_frees, kp->kp_live);
+	for (b = 0; b < KPROF_NHIST; b++) {
+		kprintf(" %5u", kp->kp_hist[b]);
+	}
+	kprintf("\n");
+}
+
+/*
+ * Print the profile: by size class (with how much of each class's
+ * blocks went unused), then the call sites with the most blocks still
+ * live, which is where to look for leaks.
+ */
+void
+kmalloc_printprofile(void)
+{
+	struct kprof_stats *kp;
+	bool printed[KPROF_NSITES];
+	unsigned i, n, best;
+
+	/* unlocked; only a snapshot */
+	kprintf("kmalloc profile (%s): %u blocks live, %u not tracked\n",
+		kprof_enabled ? "on" : "off", kprof_nlive, kprof_untracked);
+	kprintf("lifetimes:                                 <10us <100us"
+		"  <1ms <10ms <.1s   <1s  <10s longer\n");
+	kprintf("size waste   allocs     bytes   frees   live\n");
+	for (i = 0; i <= NSIZES; i++) {
+		kp = &kprof_classes[i];
+		if (kp->kp_allocs == 0) {
+			continue;
+		}
+		if (i == KPROF_BIG) {
+			kprintf(" big   -- ");
+		}
+		else {
+			/* average under 2048, so this can't overflow */
+			kprintf("%4u %4u%% ", sizes[i], 100 -
+				kp->kp_bytes / kp->kp_allocs * 100 / sizes[i]);
+		}
+		kprof_printstats(kp);
+	}
+
+	kprintf("caller       allocs     bytes   frees   live\n");
+	for (i = 0; i < KPROF_NSITES; i++) {
+		printed[i] = false;
+	}
+	for (n = 0; n < KPROF_NPRINT; n++) {
+		best = KPROF_NSITES;
+		for (i = 0; i < KPROF_NSITES; i++) {
+			if (printed[i] || kprof_sites[i].ks_caller == 0) {
+				continue;
+			}
+			if (best == KPROF_NSITES ||
+			    kprof_sites[i].ks_stats.kp_live >
+			    kprof_sites[best].ks_stats.kp_live) {
+				best = i;
+			}
+		}
+		if (best == KPROF_NSITES) {
+			break;
+		}
+		printed[best] = true;
+		kprintf("0x%08x ", kprof_sites[best].ks_caller);
+		kprof_printstats(&kprof_sites[best].ks_stats);
+	}
+	if (kprof_othersite.kp_allocs > 0) {
+		kprintf("(others)   ");
+		kprof_printstats(&kprof_othersite);
+	}
+}
+#endif /* OPT_A3 */
+
 //
 ////////////////////////////////////////////////////////////
 
 void *
 kmalloc(size_t sz)
 {
+#if OPT_A3
+	void *ptr;
+#endif
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -611,16 +1511,57 @@ kmalloc(size_t sz)
 		if (address==0) {
 			return NULL;
 		}
+#if OPT_A3
+		if (kprof_enabled) {
+			kprof_alloc((void *)address, sz,
+				    (vaddr_t)__builtin_return_address(0));
+		}
+#endif
 
 		return (void *)address;
 	}
 
+#if OPT_A3
+	if (kmag_enabled && CURCPU_EXISTS()) {
+		ptr = kmag_alloc(blocktype(sz));
+	}
+	else {
+		ptr = subpage_kmalloc(sz);
+	}
+	if (kprof_enabled && ptr != NULL) {
+		kprof_alloc(ptr, sz, (vaddr_t)__builtin_return_address(0));
+	}
+	return ptr;
+#else
 	return subpage_kmalloc(sz);
+#endif
 }
 
 void
 kfree(void *ptr)
 {
+#if OPT_A3
+	struct pageref *pr;
+
+	if (ptr == NULL) {
+		return;
+	}
+	if (kprof_enabled) {
+		kprof_free(ptr);
+	}
+	pr = findpageref(ptr);
+	if (pr == NULL) {
+		/* a big allocation */
+		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+		free_kpages((vaddr_t)ptr);
+	}
+	else if (kmag_enabled && CURCPU_EXISTS()) {
+		kmag_free(ptr, PR_BLOCKTYPE(pr));
+	}
+	else {
+		subpage_kfree(ptr);
+	}
+#else
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
@@ -630,5 +1571,6 @@ kfree(void *ptr)
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
+#endif
 }
 
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kmem_cache.h>
+
+/*
+ * Object caches. See kmem_cache.h.
+ *
+ * A cache keeps its free objects in a small array rather than a list
+ * threaded through them, since a constructed object has no word to
+ * spare for the link. When the array is full, frees go to kfree; a
+ * cache never holds more than kc_maxfree objects, and kmem_cache_reap
+ * (called by alloc_kpages when it runs out) lets go of all of them.
+ */
+
+/* all caches used so far; new ones go on the front */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+
+static volatile bool kmem_cache_enabled = true;
+
+/*
+ * Put KC on the list of caches, the first time it's used.
+ */
+static
+void
+kmem_cache_addlist(struct kmem_cache *kc)
+{
+	KASSERT(kc->kc_maxfree <= KMEM_CACHE_MAXFREE);
+
+	spinlock_acquire(&kmem_caches_lock);
+	if (!kc->kc_listed) {
+		kc->kc_next = kmem_caches;
+		kmem_caches = kc;
+		kc->kc_listed = true;
+	}
+	spinlock_release(&kmem_caches_lock);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	void *obj = NULL;
+
+	if (!kc->kc_listed) {
+		kmem_cache_addlist(kc);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_allocs++;
+	if (kc->kc_nfree > 0 && kmem_cache_enabled) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_hits++;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (obj != NULL) {
+		return obj;
+	}
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0) {
+		kfree(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	KASSERT(obj != NULL);
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_frees++;
+	if (kc->kc_nfree < kc->kc_maxfree && kmem_cache_enabled) {
+		kc->kc_free[kc->kc_nfree++] = obj;
+		obj = NULL;
+	}
+	else {
+		kc->kc_kfrees++;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (obj != NULL) {
+		if (kc->kc_dtor != NULL) {
+			kc->kc_dtor(obj);
+		}
+		kfree(obj);
+	}
+}
+
+/*
+ * Empty every cache. Destructors run without any cache locked, since
+ * they may free into other caches (a lock's destructor frees its wait
+ * channel, for instance).
+ */
+void
+kmem_cache_reap(void)
+{
+	struct kmem_cache *kc;
+	void *obj;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	/* the list only ever grows at the front, so no lock to walk it */
+	for (; kc != NULL; kc = kc->kc_next) {
+		while (1) {
+			obj = NULL;
+			spinlock_acquire(&kc->kc_lock);
+			if (kc->kc_nfree > 0) {
+				obj = kc->kc_free[--kc->kc_nfree];
+			}
+			spinlock_release(&kc->kc_lock);
+
+			if (obj == NULL) {
+				break;
+			}
+			if (kc->kc_dtor != NULL) {
+				kc->kc_dtor(obj);
+			}
+			kfree(obj);
+		}
+	}
+}
+
+bool
+kmem_cache_setenabled(bool on)
+{
+	bool old;
+
+	old = kmem_cache_enabled;
+	kmem_cache_enabled = on;
+	if (!on) {
+		kmem_cache_reap();
+	}
+	return old;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_caches_lock);
+
+	kprintf("Object caches%s:\n", kmem_cache_enabled ? "" : " (off)");
+	for (; kc != NULL; kc = kc->kc_next) {
+		kprintf("  %s: %u bytes, %u/%u held, %u allocs (%u hits), "
+			"%u frees (%u kfree'd)\n",
+			kc->kc_name, (unsigned)kc->kc_size,
+			kc->kc_nfree, kc->kc_maxfree,
+			kc->kc_allocs, kc->kc_hits,
+			kc->kc_frees, kc->kc_kfrees);
+	}
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <pagecache.h>
+
+/*
+ * Cached pages hang off a small hash table. pc_lock covers the table
+ * and every page on it, and is held across the file I/O as well, so
+ * a page is never seen half read in.
+ */
+
+#define PC_HASHSIZE 61
+
+struct pcpage {
+	struct vnode *pp_vnode;		/* file (we hold a reference) */
+	off_t pp_offset;		/* page-aligned offset in file */
+	paddr_t pp_paddr;		/* frame holding the data */
+	unsigned pp_refcount;		/* mappings of the page */
+	bool pp_dirty;			/* written since last write-back */
+	struct pcpage *pp_next;		/* hash chain */
+};
+
+static struct lock *pc_lock;
+static struct pcpage *pc_hash[PC_HASHSIZE];
+
+static unsigned pc_npages;
+static unsigned pc_hits;
+static unsigned pc_misses;
+static unsigned pc_writebacks;
+
+void
+pagecache_bootstrap(void)
+{
+	pc_lock = lock_create("pagecache");
+	if (pc_lock == NULL) {
+		panic("pagecache_bootstrap: Out of memory\n");
+	}
+}
+
+static
+unsigned
+pc_hashfn(struct vnode *vn, off_t offset)
+{
+	return ((uintptr_t)vn / sizeof(struct vnode) +
+		(unsigned)(offset / PAGE_SIZE)) % PC_HASHSIZE;
+}
+
+static
+struct pcpage **
+pc_find(struct vnode *vn, off_t offset)
+{
+	struct pcpage **pp;
+
+	KASSERT(lock_do_i_hold(pc_lock));
+
+	pp = &pc_hash[pc_hashfn(vn, offset)];
+	while (*pp != NULL) {
+		if ((*pp)->pp_vnode == vn && (*pp)->pp_offset == offset) {
+			break;
+		}
+		pp = &(*pp)->pp_next;
+	}
+	return pp;
+}
+
+/*
+ * Move one page between its frame and the file. A page that runs
+ * past end of file reads back zeros there, and writing it back mustn't
+ * stretch the file to a page boundary, so only the part inside the
+ * file is written.
+ */
+static
+int
+pc_io(struct pcpage *pp, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	size_t len = PAGE_SIZE;
+	int result;
+
+	if (rw == UIO_WRITE) {
+		result = VOP_STAT(pp->pp_vnode, &st);
+		if (result) {
+			return result;
+		}
+		if (st.st_size <= pp->pp_offset) {
+			return 0;
+		}
+		if (st.st_size - pp->pp_offset < PAGE_SIZE) {
+			len = st.st_size - pp->pp_offset;
+		}
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pp->pp_paddr), len,
+		  pp->pp_offset, rw);
+	if (rw == UIO_READ) {
+		return VOP_READ(pp->pp_vnode, &ku);
+	}
+	result = VOP_WRITE(pp->pp_vnode, &ku);
+	if (result == 0) {
+		pc_writebacks++;
+	}
+	return result;
+}
+
+int
+pagecache_get(struct vnode *vn, off_t offset, paddr_t *ret, bool *fromfile)
+{
+	struct pcpage **slot, *pp;
+	vaddr_t kva;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	lock_acquire(pc_lock);
+	slot = pc_find(vn, offset);
+	if (*slot != NULL) {
+		pp = *slot;
+		pp->pp_refcount++;
+		pc_hits++;
+		*ret = pp->pp_paddr;
+		if (fromfile != NULL) {
+			*fromfile = false;
+		}
+		lock_release(pc_lock);
+		return 0;
+	}
+
+	pp = kmalloc(sizeof(struct pcpage));
+	if (pp == NULL) {
+		lock_release(pc_lock);
+		return ENOMEM;
+	}
+	/* zeroed, for the part past end of file */
+	kva = alloc_kpage_zeroed();
+	if (kva == 0) {
+		kfree(pp);
+		lock_release(pc_lock);
+		return ENOMEM;
+	}
+
+	pp->pp_vnode = vn;
+	pp->pp_offset = offset;
+	pp->pp_paddr = KVADDR_TO_PADDR(kva);
+	pp->pp_refcount = 1;
+	pp->pp_dirty = false;
+
+	result = pc_io(pp, UIO_READ);
+	if (result) {
+		free_kpages(kva);
+		kfree(pp);
+		lock_release(pc_lock);
+		return result;
+	}
+	pc_misses++;
+
+	/* pc_lock was held throughout, so nobody else added it */
+	VOP_INCREF(vn);
+	pp->pp_next = NULL;
+	*slot = pp;
+	pc_npages++;
+
+	*ret = pp->pp_paddr;
+	if (fromfile != NULL) {
+		*fromfile = true;
+	}
+	lock_release(pc_lock);
+	return 0;
+}
+
+void
+pagecache_dirty(struct vnode *vn, off_t offset)
+{
+	struct pcpage *pp;
+
+	lock_acquire(pc_lock);
+	pp = *pc_find(vn, offset);
+	KASSERT(pp != NULL);
+	pp->pp_dirty = true;
+	lock_release(pc_lock);
+}
+
+void
+pagecache_release(struct vnode *vn, off_t offset)
+{
+	struct pcpage **slot, *pp;
+	int result;
+
+	lock_acquire(pc_lock);
+	slot = pc_find(vn, offset);
+	pp = *slot;
+	KASSERT(pp != NULL);
+	KASSERT(pp->pp_refcount > 0);
+
+	pp->pp_refcount--;
+	if (pp->pp_refcount > 0) {
+		lock_release(pc_lock);
+		return;
+	}
+
+	if (pp->pp_dirty) {
+		result = pc_io(pp, UIO_WRITE);
+		if (result) {
+			/* nobody left to tell */
+			kprintf("pagecache: write-back at %llu: %s\n",
+				(unsigned long long)pp->pp_offset,
+				strerror(result));
+		}
+	}
+	*slot = pp->pp_next;
+	pc_npages--;
+	lock_release(pc_lock);
+
+	free_kpages(PADDR_TO_KVADDR(pp->pp_paddr));
+	VOP_DECREF(pp->pp_vnode);
+	kfree(pp);
+}
+
+/*
+ * Every cached page is mapped somewhere, and its mappings stay
+ * writeable, so there's no telling whether it changes again after
+ * being written here. It stays marked dirty and the last unmap writes
+ * it once more.
+ */
+int
+pagecache_sync(struct vnode *vn)
+{
+	struct pcpage *pp;
+	unsigned i;
+	int result;
+
+	lock_acquire(pc_lock);
+	for (i = 0; i < PC_HASHSIZE; i++) {
+		for (pp = pc_hash[i]; pp != NULL; pp = pp->pp_next) {
+			if (pp->pp_vnode != vn || !pp->pp_dirty) {
+				continue;
+			}
+			result = pc_io(pp, UIO_WRITE);
+			if (result) {
+				lock_release(pc_lock);
+				return result;
+			}
+		}
+	}
+	lock_release(pc_lock);
+	return 0;
+}
+
+void
+pagecache_printstats(void)
+{
+	/* unlocked; only a snapshot */
+	kprintf("pagecache: %u pages cached, %u hits, %u misses, "
+		"%u write-backs\n",
+		pc_npages, pc_hits, pc_misses, pc_writebacks);
+}
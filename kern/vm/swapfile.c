@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swapfile.h>
+#include <zswap.h>
+#include <uw-vmstats.h>
+
+/*
+ * Swap area.
+ *
+ * Slot N lives at byte offset N * PAGE_SIZE. Which slots are in use is
+ * kept in a bitmap; nothing about a slot's contents is remembered here,
+ * the page table entry that points at it is the only record.
+ */
+
+struct lock *swap_lock;
+
+static struct vnode *swap_vnode;
+static struct bitmap *swap_map;
+static unsigned swap_nslots;
+static unsigned swap_used;
+static unsigned swap_peak;
+
+void
+swap_bootstrap(void)
+{
+	struct stat st;
+	char path[sizeof(SWAP_PATH)];
+	int result;
+
+	swap_lock = lock_create("swap");
+	if (swap_lock == NULL) {
+		panic("swap_bootstrap: Out of memory\n");
+	}
+
+	/* vfs_open wants a path it can scribble on */
+	strcpy(path, SWAP_PATH);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; swapping disabled\n",
+			SWAP_PATH, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result || st.st_size < PAGE_SIZE) {
+		kprintf("swap: %s: no usable space; swapping disabled\n",
+			SWAP_PATH);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		panic("swap_bootstrap: Out of memory\n");
+	}
+
+	zswap_bootstrap(swap_nslots);
+
+	kprintf("swap: %s, %u pages\n", SWAP_PATH, swap_nslots);
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(swap_lock));
+
+	if (swap_map == NULL) {
+		return ENOSPC;
+	}
+	result = bitmap_alloc(swap_map, slot);
+	if (result) {
+		return result;
+	}
+	swap_used++;
+	if (swap_used > swap_peak) {
+		swap_peak = swap_used;
+	}
+	return 0;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(lock_do_i_hold(swap_lock));
+	KASSERT(slot < swap_nslots);
+	KASSERT(bitmap_isset(swap_map, slot));
+
+	zswap_drop(slot);
+	bitmap_unmark(swap_map, slot);
+	swap_used--;
+}
+
+static
+int
+swap_io(unsigned slot, paddr_t pa, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(lock_do_i_hold(swap_lock));
+	KASSERT(slot < swap_nslots);
+	KASSERT((pa & PAGE_FRAME) == pa);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_pagein(unsigned slot, paddr_t pa, bool *fromdisk)
+{
+	int result;
+
+	if (zswap_load(slot, pa)) {
+		if (fromdisk != NULL) {
+			*fromdisk = false;
+		}
+		return 0;
+	}
+
+	result = swap_io(slot, pa, UIO_READ);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_SWAP_FILE_READ);
+		if (fromdisk != NULL) {
+			*fromdisk = true;
+		}
+	}
+	return result;
+}
+
+int
+swap_pageout(unsigned slot, paddr_t pa)
+{
+	int result;
+
+	if (zswap_store(slot, pa)) {
+		return 0;
+	}
+
+	result = swap_io(slot, pa, UIO_WRITE);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+	return result;
+}
+
+void
+swap_printstats(void)
+{
+	if (!swap_enabled()) {
+		kprintf("swap: disabled\n");
+		return;
+	}
+	/* unlocked; only a snapshot */
+	kprintf("swap: %u of %u pages in use (peak %u)\n",
+		swap_used, swap_nslots, swap_peak);
+	zswap_printstats();
+}
@@ -33,6 +33,9 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Page Faults from Mapped Files",
+ /* 11 */ "Faults with Fault-around",
+ /* 12 */ "TLB Prefills",
 };
 
 
@@ -112,7 +115,8 @@ vmstats_print(void)
   free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
   disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
     stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
+  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ] +
+    stats_counts[VMSTAT_MAPPED_FILE_READ];
   disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
@@ -128,10 +132,17 @@ vmstats_print(void)
       tlb_faults, disk_plus_zeroed_plus_reload); 
   }
 
-  kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
+  kprintf("VMSTAT ELF File reads + Swapfile reads + Mapped File reads = %d\n", elf_plus_swap_reads);
   if (disk_reads != elf_plus_swap_reads) {
-    kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
+    kprintf("WARNING: ELF File reads + Swapfile reads + Mapped File reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
+
+  /* Fault-around loads aren't misses, so they aren't in any of the above */
+  if (stats_counts[VMSTAT_FAULTAROUND] > 0) {
+    kprintf("VMSTAT TLB Prefills per Fault-around = %d.%02d\n",
+      stats_counts[VMSTAT_TLB_PREFILL] / stats_counts[VMSTAT_FAULTAROUND],
+      stats_counts[VMSTAT_TLB_PREFILL] * 100 / stats_counts[VMSTAT_FAULTAROUND] % 100);
+  }
 }
 /* ---------------------------------------------------------------------- */
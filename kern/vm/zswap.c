@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vm.h>
+#include <swapfile.h>
+#include <zswap.h>
+
+/*
+ * Each pooled page is a kmalloc'd block holding its compressed form;
+ * the slot table says where it is and how long. Only pages that
+ * compress to less than half a page are kept, since anything bigger
+ * would take a whole page from kmalloc anyway.
+ *
+ * Compression (and the kmalloc for the result) happens during a
+ * page-out, and kmalloc may itself need to page something out. The
+ * inner page-out finds the pool busy and goes to disk.
+ */
+#define ZSWAP_MAXLEN    (PAGE_SIZE / 2 - 1)
+#define ZSWAP_DEFMAX    64	/* pages of compressed data */
+
+struct zslot {
+	void *zs_data;		/* compressed page, or NULL */
+	unsigned zs_len;
+};
+
+static struct zslot *zswap_slots;
+static unsigned zswap_nslots;
+static unsigned zswap_max = ZSWAP_DEFMAX;
+static bool zswap_busy;		/* zswap_buf in use */
+static uint8_t zswap_buf[ZSWAP_MAXLEN];
+
+static unsigned zswap_npages;	/* pages in the pool */
+static unsigned zswap_bytes;	/* ...and their compressed size */
+
+/* statistics */
+static unsigned zswap_stores;	/* pages put in the pool */
+static unsigned zswap_todisk;	/* pages left to go to disk */
+static unsigned zswap_rejects;	/* ...because they didn't compress */
+static unsigned zswap_full;	/* ...because they didn't fit */
+static unsigned zswap_hits;	/* page-ins from the pool */
+static unsigned zswap_misses;	/* ...from disk */
+
+/*
+ * The compressor.
+ *
+ * A simple LZ77 with a one-way hash table of three-byte strings, in
+ * the style of LZRW1: fast, and good at the zero runs and repeated
+ * words most user pages are full of. The output is a series of
+ * groups, each a control byte and up to eight items, one per bit
+ * (lowest first): 0 is a literal byte, 1 a back reference of two
+ * bytes, length-3 in the top four bits and a 12-bit distance in the
+ * rest. A length code of 15 is followed by a byte to add to it.
+ */
+#define LZ_HASHBITS     10
+#define LZ_MINLEN       3
+#define LZ_MAXLEN       (LZ_MINLEN + 15 + 255)
+#define LZ_MAXOFF       4095
+#define LZ_HASH(p)      ((((uint32_t)(p)[0] << 16 | (uint32_t)(p)[1] << 8 | \
+			   (p)[2]) * 2654435761U) >> (32 - LZ_HASHBITS))
+
+/*
+ * Last position each string was seen at. Stale entries from earlier
+ * pages are harmless, since a match is always checked.
+ */
+static uint16_t lz_table[1 << LZ_HASHBITS];
+
+/*
+ * Compress the page at SRC into DST. Returns the compressed length,
+ * or 0 if it would be longer than MAX.
+ */
+static
+size_t
+lz_compress(const uint8_t *src, uint8_t *dst, size_t max)
+{
+	size_t ip, op, ctl, cand, len;
+	unsigned bit, h, code;
+
+	ip = op = ctl = 0;
+	bit = 8;
+	while (ip < PAGE_SIZE) {
+		if (bit == 8) {
+			if (op >= max) {
+				return 0;
+			}
+			ctl = op++;
+			dst[ctl] = 0;
+			bit = 0;
+		}
+
+		len = 0;
+		cand = 0;
+		if (ip + LZ_MINLEN <= PAGE_SIZE) {
+			h = LZ_HASH(src + ip);
+			cand = lz_table[h];
+			lz_table[h] = ip;
+			if (cand < ip && ip - cand <= LZ_MAXOFF &&
+			    src[cand] == src[ip] &&
+			    src[cand + 1] == src[ip + 1] &&
+			    src[cand + 2] == src[ip + 2]) {
+				len = LZ_MINLEN;
+				while (len < LZ_MAXLEN && ip + len < PAGE_SIZE &&
+				       src[cand + len] == src[ip + len]) {
+					len++;
+				}
+			}
+		}
+
+		if (len > 0) {
+			code = len - LZ_MINLEN < 15 ? len - LZ_MINLEN : 15;
+			if (op + (code == 15 ? 3 : 2) > max) {
+				return 0;
+			}
+			dst[op++] = (code << 4) | ((ip - cand) >> 8);
+			dst[op++] = (ip - cand) & 0xff;
+			if (code == 15) {
+				dst[op++] = len - LZ_MINLEN - 15;
+			}
+			dst[ctl] |= 1 << bit;
+			ip += len;
+		}
+		else {
+			if (op >= max) {
+				return 0;
+			}
+			dst[op++] = src[ip++];
+		}
+		bit++;
+	}
+	return op;
+}
+
+/*
+ * Expand LEN bytes at SRC into the page at DST. Returns EIO if they
+ * don't make exactly one page.
+ */
+static
+int
+lz_decompress(const uint8_t *src, size_t len, uint8_t *dst)
+{
+	size_t ip, op, off, mlen;
+	unsigned bit, ctl;
+
+	ip = op = 0;
+	ctl = 0;
+	bit = 8;
+	while (op < PAGE_SIZE) {
+		if (bit == 8) {
+			if (ip >= len) {
+				return EIO;
+			}
+			ctl = src[ip++];
+			bit = 0;
+		}
+
+		if (ctl & (1 << bit)) {
+			if (ip + 2 > len) {
+				return EIO;
+			}
+			mlen = (src[ip] >> 4) + LZ_MINLEN;
+			off = ((size_t)(src[ip] & 0xf) << 8) | src[ip + 1];
+			ip += 2;
+			if (mlen == LZ_MINLEN + 15) {
+				if (ip >= len) {
+					return EIO;
+				}
+				mlen += src[ip++];
+			}
+			if (off == 0 || off > op || op + mlen > PAGE_SIZE) {
+				return EIO;
+			}
+			/* byte by byte: the copy may overlap itself */
+			for (; mlen > 0; mlen--, op++) {
+				dst[op] = dst[op - off];
+			}
+		}
+		else {
+			if (ip >= len) {
+				return EIO;
+			}
+			dst[op++] = src[ip++];
+		}
+		bit++;
+	}
+	return ip == len ? 0 : EIO;
+}
+
+void
+zswap_bootstrap(unsigned nslots)
+{
+	unsigned i;
+
+	zswap_slots = kmalloc(nslots * sizeof(struct zslot));
+	if (zswap_slots == NULL) {
+		panic("zswap_bootstrap: Out of memory\n");
+	}
+	for (i = 0; i < nslots; i++) {
+		zswap_slots[i].zs_data = NULL;
+		zswap_slots[i].zs_len = 0;
+	}
+	zswap_nslots = nslots;
+}
+
+bool
+zswap_store(unsigned slot, paddr_t pa)
+{
+	void *data;
+	size_t len;
+
+	KASSERT(lock_do_i_hold(swap_lock));
+	KASSERT(slot < zswap_nslots);
+	KASSERT(zswap_slots[slot].zs_data == NULL);
+
+	if (zswap_max == 0 || zswap_busy) {
+		zswap_todisk++;
+		return false;
+	}
+	if (zswap_bytes >= zswap_max * PAGE_SIZE) {
+		zswap_todisk++;
+		zswap_full++;
+		return false;
+	}
+
+	zswap_busy = true;
+	len = lz_compress((const uint8_t *)PADDR_TO_KVADDR(pa), zswap_buf,
+			  ZSWAP_MAXLEN);
+	if (len == 0) {
+		zswap_busy = false;
+		zswap_todisk++;
+		zswap_rejects++;
+		return false;
+	}
+	data = kmalloc(len);
+	if (data == NULL) {
+		zswap_busy = false;
+		zswap_todisk++;
+		zswap_full++;
+		return false;
+	}
+	memcpy(data, zswap_buf, len);
+	zswap_busy = false;
+
+	zswap_slots[slot].zs_data = data;
+	zswap_slots[slot].zs_len = len;
+	zswap_npages++;
+	zswap_bytes += len;
+	zswap_stores++;
+	return true;
+}
+
+bool
+zswap_load(unsigned slot, paddr_t pa)
+{
+	struct zslot *zs;
+	int result;
+
+	KASSERT(lock_do_i_hold(swap_lock));
+	KASSERT(slot < zswap_nslots);
+
+	zs = &zswap_slots[slot];
+	if (zs->zs_data == NULL) {
+		zswap_misses++;
+		return false;
+	}
+	result = lz_decompress(zs->zs_data, zs->zs_len,
+			       (uint8_t *)PADDR_TO_KVADDR(pa));
+	if (result) {
+		panic("zswap: slot %u is corrupt\n", slot);
+	}
+	zswap_hits++;
+	return true;
+}
+
+void
+zswap_drop(unsigned slot)
+{
+	struct zslot *zs;
+
+	KASSERT(lock_do_i_hold(swap_lock));
+	KASSERT(slot < zswap_nslots);
+
+	zs = &zswap_slots[slot];
+	if (zs->zs_data == NULL) {
+		return;
+	}
+	zswap_npages--;
+	zswap_bytes -= zs->zs_len;
+	kfree(zs->zs_data);
+	zs->zs_data = NULL;
+	zs->zs_len = 0;
+}
+
+unsigned
+zswap_setmax(unsigned npages)
+{
+	unsigned old;
+
+	/* pages already in the pool stay until their slots are freed */
+	old = zswap_max;
+	zswap_max = npages;
+	return old;
+}
+
+void
+zswap_printstats(void)
+{
+	/* unlocked; only a snapshot */
+	kprintf("zswap: %u pages in %u bytes", zswap_npages, zswap_bytes);
+	if (zswap_bytes > 0) {
+		kprintf(" (%u.%02u:1)",
+			zswap_npages * PAGE_SIZE / zswap_bytes,
+			zswap_npages * PAGE_SIZE * 100 / zswap_bytes % 100);
+	}
+	kprintf(", limit %u pages\n", zswap_max);
+	kprintf("zswap: %u stored, %u to disk (%u incompressible, "
+		"%u pool full); page-ins: %u from pool, %u from disk\n",
+		zswap_stores, zswap_todisk, zswap_rejects,
+		zswap_full, zswap_hits, zswap_misses);
+}